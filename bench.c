@@ -0,0 +1,83 @@
+#include "simple_kpc.h"
+#include <stdint.h>
+#include <stdio.h>
+#include <time.h>
+
+// Measures what simple_kpc itself costs around an empty region. Against
+// kperf_stub.c this is pure library overhead, since the stub’s kpc calls are
+// ordinary function calls rather than syscalls. It also checks that
+// sk_count_instructions subtracts its own overhead exactly.
+
+#define ITERATIONS 1000000
+
+static void empty_callback(void *context)
+{
+	(void)context;
+}
+
+static uint64_t now_ns(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + (uint64_t)ts.tv_nsec;
+}
+
+int main()
+{
+	sk_init();
+
+	sk_events *e = sk_events_create();
+	sk_events_push(e, "cycles", "FIXED_CYCLES");
+	sk_events_push(e, "instructions", "FIXED_INSTRUCTIONS");
+	sk_events_push(e, "branches", "INST_BRANCH");
+	sk_events_push(e, "branch misses", "BRANCH_MISPRED_NONSPEC");
+
+	sk_result result;
+	uint64_t start = now_ns();
+	for (uint32_t i = 0; i < ITERATIONS; i++) {
+		sk_in_progress_measurement *m = sk_start_measurement(e);
+		sk_stop_measurement(m, &result);
+	}
+	uint64_t elapsed = now_ns() - start;
+	printf("start/stop:  %8.1f ns per pair\n",
+	       (double)elapsed / ITERATIONS);
+
+	sk_counter_reader read = sk_get_counter_reader();
+	uint64_t buf[SK_MAX_COUNTERS];
+	sk_events_arm(e);
+	start = now_ns();
+	for (uint32_t i = 0; i < ITERATIONS; i++) {
+		read(0, SK_MAX_COUNTERS, buf);
+		read(0, SK_MAX_COUNTERS, buf);
+	}
+	elapsed = now_ns() - start;
+	sk_events_disarm(e);
+	printf("raw reads:   %8.1f ns per pair\n",
+	       (double)elapsed / ITERATIONS);
+
+	sk_sketch *sketch = sk_sketch_create(0);
+	uint64_t x = 88172645463325252ull;
+	start = now_ns();
+	for (uint32_t i = 0; i < 10 * ITERATIONS; i++) {
+		x ^= x << 13;
+		x ^= x >> 7;
+		x ^= x << 17;
+		sk_sketch_update(sketch, x % 1000000);
+	}
+	elapsed = now_ns() - start;
+	sk_sketch_destroy(sketch);
+	printf("sketch:      %8.1f ns per update\n",
+	       (double)elapsed / (10 * ITERATIONS));
+
+	sk_events_destroy(e);
+
+	uint64_t instructions = 0;
+	if (sk_count_instructions(empty_callback, NULL, &instructions) != 0 ||
+	    instructions != 0) {
+		fprintf(stderr,
+			"bench: empty callback counted %llu instructions\n",
+			(unsigned long long)instructions);
+		return 1;
+	}
+	return 0;
+}
@@ -0,0 +1,144 @@
+#include "simple_kpc.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+// Checks core type discovery against fake sysfs trees. Each case runs sk_init
+// in a child, since the host is gathered only once per process, and replays
+// an empty trace so no kperf is needed.
+
+#define MAX_PMUS 4
+
+typedef struct {
+	const char *name;
+	const char *pmus[MAX_PMUS]; // “name=cpu list”
+	size_t expected_count;
+	const char *expected_names[MAX_PMUS];
+	int expected_cpus[MAX_PMUS];
+} fixture;
+
+static const fixture FIXTURES[] = {
+	{
+		.name = "hybrid",
+		.pmus = { "cpu_core=0-3,8-11", "cpu_atom=4-7", "power=" },
+		.expected_count = 2,
+		.expected_names = { "cpu_atom", "cpu_core" },
+		.expected_cpus = { 4, 8 },
+	},
+	{
+		.name = "one PMU with a cpus file",
+		.pmus = { "armv8_pmuv3_0=0-7" },
+		.expected_count = 0,
+	},
+	{
+		.name = "no PMUs",
+		.expected_count = 0,
+	},
+};
+
+static void write_file(const char *path, const char *contents)
+{
+	FILE *f = fopen(path, "w");
+	if (!f) {
+		perror(path);
+		exit(1);
+	}
+	fputs(contents, f);
+	fclose(f);
+}
+
+// “name=” makes a PMU without a cpus file, like the plain “cpu” one.
+static void build_tree(const char *root, const fixture *fx)
+{
+	char path[512];
+	snprintf(path, sizeof(path), "%s/bus", root);
+	mkdir(path, 0755);
+	snprintf(path, sizeof(path), "%s/bus/event_source", root);
+	mkdir(path, 0755);
+	snprintf(path, sizeof(path), "%s/bus/event_source/devices", root);
+	mkdir(path, 0755);
+
+	for (size_t i = 0; i < MAX_PMUS && fx->pmus[i]; i++) {
+		char name[64];
+		snprintf(name, sizeof(name), "%s", fx->pmus[i]);
+		char *cpus = strchr(name, '=');
+		*cpus++ = '\0';
+
+		snprintf(path, sizeof(path), "%s/bus/event_source/devices/%s",
+			 root, name);
+		mkdir(path, 0755);
+		if (*cpus) {
+			snprintf(path, sizeof(path),
+				 "%s/bus/event_source/devices/%s/cpus", root,
+				 name);
+			write_file(path, cpus);
+		}
+	}
+}
+
+static int check(const fixture *fx)
+{
+	const sk_host *h = sk_host_get();
+	int failures = 0;
+	if (h->core_type_count != fx->expected_count) {
+		fprintf(stderr, "%s: %zu core types, expected %zu\n", fx->name,
+			h->core_type_count, fx->expected_count);
+		return 1;
+	}
+	for (size_t i = 0; i < fx->expected_count; i++) {
+		if (strcmp(h->core_types[i].name, fx->expected_names[i]) != 0 ||
+		    h->core_types[i].cpus != fx->expected_cpus[i]) {
+			fprintf(stderr, "%s: core type %zu is %s with %d CPUs, "
+					"expected %s with %d\n",
+				fx->name, i, h->core_types[i].name,
+				h->core_types[i].cpus, fx->expected_names[i],
+				fx->expected_cpus[i]);
+			failures++;
+		}
+	}
+	return failures;
+}
+
+int main()
+{
+	char root[] = "/tmp/simple_kpc_sysfs_XXXXXX";
+	if (!mkdtemp(root)) {
+		perror("mkdtemp");
+		return 1;
+	}
+	char trace[sizeof(root) + 16];
+	snprintf(trace, sizeof(trace), "%s/trace", root);
+	write_file(trace, "simple-kpc trace 2\n");
+
+	int failures = 0;
+	for (size_t i = 0; i < sizeof(FIXTURES) / sizeof(FIXTURES[0]); i++) {
+		const fixture *fx = &FIXTURES[i];
+		char sysfs[sizeof(root) + 16];
+		snprintf(sysfs, sizeof(sysfs), "%s/%zu", root, i);
+		mkdir(sysfs, 0755);
+		build_tree(sysfs, fx);
+
+		fflush(NULL);
+		pid_t pid = fork();
+		if (pid == 0) {
+			setenv("SK_SYSFS_PATH", sysfs, 1);
+			setenv("SK_REPLAY", trace, 1);
+			sk_init();
+			_exit(check(fx) ? 1 : 0);
+		}
+		int status = 0;
+		waitpid(pid, &status, 0);
+		int passed = WIFEXITED(status) && WEXITSTATUS(status) == 0;
+		printf("%-28s %s\n", fx->name, passed ? "ok" : "FAILED");
+		failures += !passed;
+	}
+
+	char command[sizeof(root) + 16];
+	snprintf(command, sizeof(command), "rm -rf %s", root);
+	if (system(command) != 0)
+		fprintf(stderr, "failed to remove %s\n", root);
+	return failures ? 1 : 0;
+}
@@ -0,0 +1,284 @@
+// A stand-in for kperf.framework and kperfdata.framework, so simple_kpc runs
+// (and can be benchmarked) anywhere dlopen does. Build it as a shared library
+// and point both SK_KPERF_PATH and SK_KPERFDATA_PATH at it.
+//
+// Counters follow a scriptable model instead of hardware:
+//
+//   KPERF_STUB_EVENTS    comma-separated NAME=RATE pairs; each counter holding
+//                        NAME advances by RATE per nanosecond of counting.
+//                        Defaults to a handful of Apple Silicon event names.
+//   KPERF_STUB_CLOCK     “reads” advances time by exactly 1000ns per counter
+//                        read instead of following the monotonic clock, which
+//                        makes every count deterministic.
+//   KPERF_STUB_COUNTERS  how many counters there are (default 10), after which
+//                        kpep_config_add_event fails.
+//   KPERF_STUB_DENY      if set, kpc_force_all_ctrs_get fails as it does for
+//                        non-root processes.
+//   KPERF_STUB_KERNEL    the fraction of every event that happens in the
+//                        kernel (default 0), which counters added as user
+//                        space only leave out.
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+typedef uint32_t u32;
+typedef uint64_t u64;
+typedef size_t usize;
+
+#define MAX_EVENTS 64
+#define MAX_COUNTERS 32
+#define READ_TICK_NS 1000
+
+// Set in a register value for counters added as user space only.
+#define USER_ONLY_BIT (1ull << 32)
+
+typedef struct kpep_event {
+	char name[64];
+	double rate;
+} kpep_event;
+
+typedef struct kpep_db {
+	kpep_event *events;
+	usize event_count;
+} kpep_db;
+
+typedef struct kpep_config {
+	kpep_event *events[MAX_COUNTERS];
+	bool user_only[MAX_COUNTERS];
+	usize event_count;
+} kpep_config;
+
+static const char DEFAULT_EVENTS[] = "FIXED_CYCLES=3,"
+				     "FIXED_INSTRUCTIONS=4,"
+				     "INST_BRANCH=0.8,"
+				     "BRANCH_MISPRED_NONSPEC=0.01,"
+				     "L1D_CACHE_MISS_LD=0.05,"
+				     "L1D_CACHE_MISS_ST=0.02,"
+				     "INST_LDST=1.2";
+
+static kpep_event model[MAX_EVENTS];
+static usize model_count = 0;
+static usize counter_count = 10;
+static double kernel_share = 0;
+static bool tick_per_read = false;
+static bool loaded = false;
+
+// Which model event each counter holds, as programmed by kpc_set_config.
+static kpep_event *programmed[MAX_COUNTERS];
+static bool programmed_user_only[MAX_COUNTERS];
+static double values[MAX_COUNTERS];
+static u32 counting = 0;
+static u64 last_ns = 0;
+
+static void load_model(void)
+{
+	if (loaded)
+		return;
+	loaded = true;
+
+	const char *counters = getenv("KPERF_STUB_COUNTERS");
+	if (counters) {
+		counter_count = strtoul(counters, NULL, 10);
+		if (counter_count > MAX_COUNTERS)
+			counter_count = MAX_COUNTERS;
+	}
+
+	const char *kernel = getenv("KPERF_STUB_KERNEL");
+	if (kernel)
+		kernel_share = strtod(kernel, NULL);
+
+	const char *clock = getenv("KPERF_STUB_CLOCK");
+	tick_per_read = clock && strcmp(clock, "reads") == 0;
+
+	const char *spec = getenv("KPERF_STUB_EVENTS");
+	if (!spec)
+		spec = DEFAULT_EVENTS;
+
+	char *copy = strdup(spec);
+	for (char *pair = strtok(copy, ","); pair && model_count < MAX_EVENTS;
+	     pair = strtok(NULL, ",")) {
+		char *equals = strchr(pair, '=');
+		if (!equals)
+			continue;
+		*equals = '\0';
+
+		kpep_event *event = &model[model_count++];
+		snprintf(event->name, sizeof(event->name), "%s", pair);
+		event->rate = strtod(equals + 1, NULL);
+	}
+	free(copy);
+}
+
+static u64 now_ns(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (u64)ts.tv_sec * 1000000000 + (u64)ts.tv_nsec;
+}
+
+static void advance(u64 elapsed_ns)
+{
+	if (!counting)
+		return;
+	for (usize i = 0; i < MAX_COUNTERS; i++) {
+		if (!programmed[i])
+			continue;
+		double share = programmed_user_only[i] ? 1 - kernel_share : 1;
+		values[i] += programmed[i]->rate * share * (double)elapsed_ns;
+	}
+}
+
+static void catch_up(void)
+{
+	u64 now = now_ns();
+	if (!tick_per_read)
+		advance(now - last_ns);
+	last_ns = now;
+}
+
+int kpc_set_counting(u32 classes)
+{
+	catch_up();
+	counting = classes;
+	return 0;
+}
+
+int kpc_set_thread_counting(u32 classes)
+{
+	(void)classes;
+	return 0;
+}
+
+int kpc_set_config(u32 classes, u64 *config)
+{
+	(void)classes;
+	load_model();
+	catch_up();
+	for (usize i = 0; i < MAX_COUNTERS; i++) {
+		u64 event = config[i] & ~USER_ONLY_BIT;
+		programmed[i] = NULL;
+		programmed_user_only[i] = config[i] & USER_ONLY_BIT;
+		if (i < counter_count && event && event <= model_count)
+			programmed[i] = &model[event - 1];
+	}
+	return 0;
+}
+
+int kpc_get_thread_counters(u32 tid, u32 buf_count, u64 *buf)
+{
+	(void)tid;
+	if (tick_per_read)
+		advance(READ_TICK_NS);
+	else
+		catch_up();
+
+	for (u32 i = 0; i < buf_count; i++)
+		buf[i] = i < MAX_COUNTERS ? (u64)values[i] : 0;
+	return 0;
+}
+
+int kpc_force_all_ctrs_set(int val)
+{
+	(void)val;
+	return 0;
+}
+
+int kpc_force_all_ctrs_get(int *val_out)
+{
+	if (getenv("KPERF_STUB_DENY"))
+		return -1;
+	if (val_out)
+		*val_out = 1;
+	return 0;
+}
+
+int kpep_config_create(kpep_db *db, kpep_config **cfg_ptr)
+{
+	(void)db;
+	*cfg_ptr = calloc(1, sizeof(kpep_config));
+	return 0;
+}
+
+void kpep_config_free(kpep_config *cfg)
+{
+	free(cfg);
+}
+
+int kpep_config_add_event(kpep_config *cfg, kpep_event **ev_ptr, u32 flag,
+			  u32 *err)
+{
+	if (cfg->event_count >= counter_count) {
+		if (err)
+			*err = 0;
+		return 1;
+	}
+	cfg->user_only[cfg->event_count] = flag == 1;
+	cfg->events[cfg->event_count++] = *ev_ptr;
+	return 0;
+}
+
+int kpep_config_force_counters(kpep_config *cfg)
+{
+	(void)cfg;
+	return 0;
+}
+
+// Counter i holds the i’th added event; the register value is the event’s
+// position in the model plus one, so zero means “unused”, with USER_ONLY_BIT
+// set for user-space-only counters.
+int kpep_config_kpc(kpep_config *cfg, u64 *buf, usize buf_size)
+{
+	usize n = buf_size / sizeof(u64);
+	for (usize i = 0; i < n; i++) {
+		buf[i] = 0;
+		if (i < cfg->event_count)
+			buf[i] = ((u64)(cfg->events[i] - model) + 1) |
+				 (cfg->user_only[i] ? USER_ONLY_BIT : 0);
+	}
+	return 0;
+}
+
+int kpep_config_kpc_classes(kpep_config *cfg, u32 *classes_ptr)
+{
+	*classes_ptr = cfg->event_count ? 3 : 0;
+	return 0;
+}
+
+int kpep_config_kpc_map(kpep_config *cfg, usize *buf, usize buf_size)
+{
+	usize n = buf_size / sizeof(usize);
+	for (usize i = 0; i < n && i < cfg->event_count; i++)
+		buf[i] = i;
+	return 0;
+}
+
+int kpep_db_create(const char *name, kpep_db **db_ptr)
+{
+	(void)name;
+	load_model();
+	kpep_db *db = calloc(1, sizeof(kpep_db));
+	*db = (kpep_db){ .events = model, .event_count = model_count };
+	*db_ptr = db;
+	return 0;
+}
+
+void kpep_db_free(kpep_db *db)
+{
+	free(db);
+}
+
+int kpep_db_event(kpep_db *db, const char *name, kpep_event **ev_ptr)
+{
+	for (usize i = 0; i < db->event_count; i++) {
+		if (strcmp(db->events[i].name, name) == 0) {
+			*ev_ptr = &db->events[i];
+			return 0;
+		}
+	}
+	*ev_ptr = NULL;
+	return 1;
+}
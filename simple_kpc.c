@@ -1,13 +1,38 @@
+#define _GNU_SOURCE // for sched_getcpu and RUSAGE_THREAD on Linux
+
 #include "simple_kpc.h"
 
 #include <assert.h>
+#include <dirent.h>
 #include <dlfcn.h>
+#include <errno.h>
 #include <locale.h>
+#include <math.h>
+#include <pthread.h>
+#include <sched.h>
+#include <signal.h>
+#include <stdatomic.h>
 #include <stdbool.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
+#include <sys/ptrace.h>
+#include <sys/resource.h>
+#include <sys/types.h>
+#include <sys/utsname.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#ifdef __APPLE__
+#include <libkern/OSCacheControl.h>
+#include <libproc.h>
+#include <mach/mach.h>
+#include <mach/thread_policy.h>
+#include <sys/sysctl.h>
+#endif
 
 typedef int8_t i8;
 typedef uint8_t u8;
@@ -21,7 +46,7 @@ typedef size_t usize;
 
 #define ARRAY_LENGTH(x) (sizeof(x) / sizeof((x)[0]))
 
-#define KPC_MAX_COUNTERS 32
+#define KPC_MAX_COUNTERS SK_MAX_COUNTERS
 
 typedef struct kpep_db kpep_db;
 typedef struct kpep_config kpep_config;
@@ -71,18 +96,836 @@ static const symbol KPERFDATA_SYMBOLS[] = {
 	SYMBOL(kpep_db_free),	       SYMBOL(kpep_db_event),
 };
 
+// Both paths can be overridden at build time, or at run time through
+// SK_KPERF_PATH and SK_KPERFDATA_PATH (for instance to load kperf_stub.c).
+#ifndef KPERF_PATH
 #define KPERF_PATH "/System/Library/PrivateFrameworks/kperf.framework/kperf"
+#endif
+#ifndef KPERFDATA_PATH
 #define KPERFDATA_PATH                                                         \
 	"/System/Library/PrivateFrameworks/kperfdata.framework/kperfdata"
+#endif
+
+static const char *path_from_env(const char *name, const char *fallback)
+{
+	const char *path = getenv(name);
+	return path && *path ? path : fallback;
+}
+
+static void *xrealloc(void *p, usize size)
+{
+	p = realloc(p, size);
+	if (!p) {
+		fprintf(stderr, "simple_kpc: out of memory\n");
+		exit(1);
+	}
+	return p;
+}
+
+static usize grown_capacity(usize capacity, usize needed)
+{
+	if (capacity == 0)
+		capacity = 8;
+	while (capacity < needed)
+		capacity *= 2;
+	return capacity;
+}
+
+// Traces. With SK_RECORD=path, every configuration and counter read that goes
+// through kpc is kept in memory and written to path at exit. With
+// SK_REPLAY=path, sk_init loads no frameworks at all and the kpc functions
+// hand those values back in the same order, so analysis and reporting code can
+// be run (and benchmarked) reproducibly on machines without counters.
+//
+// The harnesses’ random seeds are traced too, since they decide which side of
+// a comparison runs first and so which reads belong to which, and so is the
+// scheduling state read around measurements, which decides which runs are
+// disturbed and measured again.
+//
+// The file is text: a “simple-kpc trace 2” header, then one record per line,
+// “<kind> <n> <value>...”.
+//
+// A recorded read is appended right after the real one, inside whatever is
+// being measured, so recording never allocates: the buffer is sized (from
+// SK_RECORD_READS) and touched up front, and once it is full nothing more is
+// recorded. Sampler signal handlers can’t share it, so starting a sampler
+// stops recording.
+
+typedef enum {
+	TRACE_CLASSES,
+	TRACE_MAP,
+	TRACE_READ,
+	TRACE_SEED,
+	TRACE_SCHEDULING,
+	TRACE_KIND_COUNT,
+} trace_kind;
+
+#define TRACE_VERSION 2
+
+static const char *const TRACE_KIND_NAMES[] = {
+	"classes", "map", "read", "seed", "scheduling",
+};
+
+// Records are packed as kind, n, then n values. Each kind is replayed from its
+// own cursor, so reads keep flowing even if a caller compiles events lazily.
+static struct {
+	u64 *words;
+	usize length;
+	usize capacity;
+	usize cursors[TRACE_KIND_COUNT];
+	const char *path;
+	bool recording;
+	bool replaying;
+	bool full;
+} trace;
+
+#define DEFAULT_RECORD_READS (1 << 15)
+#define TRACE_CONFIG_WORDS 1024
+
+static void trace_push(trace_kind kind, usize n, const u64 *values)
+{
+	trace.words[trace.length++] = kind;
+	trace.words[trace.length++] = n;
+	memcpy(trace.words + trace.length, values, n * sizeof(u64));
+	trace.length += n;
+}
+
+static void trace_append(trace_kind kind, usize n, const u64 *values)
+{
+	if (trace.length + 2 + n > trace.capacity) {
+		trace.capacity = grown_capacity(trace.capacity,
+						trace.length + 2 + n);
+		trace.words = xrealloc(trace.words,
+				       trace.capacity * sizeof(u64));
+	}
+	trace_push(kind, n, values);
+}
+
+// Stops at the first record that doesn’t fit, so the trace stays a prefix of
+// what happened and replays consistently up to where it ends.
+static void trace_record(trace_kind kind, usize n, const u64 *values)
+{
+	if (!trace.recording || trace.full)
+		return;
+	if (trace.length + 2 + n > trace.capacity) {
+		trace.full = true;
+		return;
+	}
+	trace_push(kind, n, values);
+}
+static const u64 *trace_next(trace_kind kind, usize *n)
+{
+	usize *cursor = &trace.cursors[kind];
+	while (*cursor < trace.length) {
+		const u64 *record = trace.words + *cursor;
+		*cursor += 2 + record[1];
+		if (record[0] == kind) {
+			*n = record[1];
+			return record + 2;
+		}
+	}
+
+	fprintf(stderr, "simple_kpc: replay trace %s has no more %s records\n",
+		trace.path, TRACE_KIND_NAMES[kind]);
+	exit(1);
+}
+
+static void write_trace(void)
+{
+	FILE *f = fopen(trace.path, "w");
+	if (!f) {
+		fprintf(stderr, "simple_kpc: failed to write trace %s\n",
+			trace.path);
+		return;
+	}
+	if (trace.full)
+		fprintf(stderr,
+			"simple_kpc: trace %s filled up and was cut short; "
+			"raise SK_RECORD_READS to keep more\n",
+			trace.path);
+
+	fprintf(f, "simple-kpc trace %d\n", TRACE_VERSION);
+	for (usize i = 0; i < trace.length;) {
+		const u64 *record = trace.words + i;
+		fprintf(f, "%s %llu", TRACE_KIND_NAMES[record[0]],
+			(unsigned long long)record[1]);
+		for (usize j = 0; j < record[1]; j++)
+			fprintf(f, " %llu", (unsigned long long)record[2 + j]);
+		fprintf(f, "\n");
+		i += 2 + record[1];
+	}
+	fclose(f);
+}
+
+static void read_trace(const char *path)
+{
+	trace.path = path;
+	FILE *f = fopen(path, "r");
+	int version = 0;
+	if (!f || fscanf(f, "simple-kpc trace %d", &version) != 1) {
+		fprintf(stderr, "simple_kpc: %s is not a simple-kpc trace\n",
+			path);
+		exit(1);
+	}
+	if (version != TRACE_VERSION) {
+		fprintf(stderr,
+			"simple_kpc: trace %s is version %d, but only version "
+			"%d can be replayed; record it again\n",
+			path, version, TRACE_VERSION);
+		exit(1);
+	}
+
+	char kind_name[16];
+	unsigned long long n = 0;
+	while (fscanf(f, "%15s %llu", kind_name, &n) == 2) {
+		usize kind = 0;
+		while (kind < TRACE_KIND_COUNT &&
+		       strcmp(kind_name, TRACE_KIND_NAMES[kind]) != 0)
+			kind++;
+		if (kind == TRACE_KIND_COUNT || n > KPC_MAX_COUNTERS) {
+			fprintf(stderr, "simple_kpc: bad record in trace %s\n",
+				path);
+			exit(1);
+		}
+
+		u64 values[KPC_MAX_COUNTERS] = { 0 };
+		for (usize i = 0; i < n; i++) {
+			unsigned long long value = 0;
+			if (fscanf(f, "%llu", &value) != 1) {
+				fprintf(stderr,
+					"simple_kpc: truncated trace %s\n",
+					path);
+				exit(1);
+			}
+			values[i] = value;
+		}
+		trace_append(kind, n, values);
+	}
+	fclose(f);
+}
+
+// Recording wraps the three kpc functions whose results the library keeps.
+static int (*recorded_kpc_get_thread_counters)(u32, u32, u64 *);
+static int (*recorded_kpep_config_kpc_classes)(kpep_config *, u32 *);
+static int (*recorded_kpep_config_kpc_map)(kpep_config *, usize *, usize);
+
+static int record_thread_counters(u32 tid, u32 buf_count, u64 *buf)
+{
+	int result = recorded_kpc_get_thread_counters(tid, buf_count, buf);
+	trace_record(TRACE_READ, buf_count, buf);
+	return result;
+}
+
+static int record_kpc_classes(kpep_config *cfg, u32 *classes_ptr)
+{
+	int result = recorded_kpep_config_kpc_classes(cfg, classes_ptr);
+	u64 classes = *classes_ptr;
+	trace_record(TRACE_CLASSES, 1, &classes);
+	return result;
+}
+
+static int record_kpc_map(kpep_config *cfg, usize *buf, usize buf_size)
+{
+	int result = recorded_kpep_config_kpc_map(cfg, buf, buf_size);
+	u64 map[KPC_MAX_COUNTERS] = { 0 };
+	usize n = buf_size / sizeof(usize);
+	for (usize i = 0; i < n && i < KPC_MAX_COUNTERS; i++)
+		map[i] = buf[i];
+	trace_record(TRACE_MAP, n < KPC_MAX_COUNTERS ? n : KPC_MAX_COUNTERS,
+		     map);
+	return result;
+}
+
+static void start_recording(const char *path)
+{
+	usize reads = DEFAULT_RECORD_READS;
+	const char *reads_text = getenv("SK_RECORD_READS");
+	if (reads_text && strtoull(reads_text, NULL, 10) > 0)
+		reads = strtoull(reads_text, NULL, 10);
+
+	// Room for every read at its largest, plus a little for configurations.
+	trace.path = path;
+	trace.capacity = reads * (2 + KPC_MAX_COUNTERS) + TRACE_CONFIG_WORDS;
+	trace.words = xrealloc(NULL, trace.capacity * sizeof(u64));
+	memset(trace.words, 0, trace.capacity * sizeof(u64));
+	trace.recording = true;
+
+	recorded_kpc_get_thread_counters = kpc_get_thread_counters;
+	recorded_kpep_config_kpc_classes = kpep_config_kpc_classes;
+	recorded_kpep_config_kpc_map = kpep_config_kpc_map;
+	kpc_get_thread_counters = record_thread_counters;
+	kpep_config_kpc_classes = record_kpc_classes;
+	kpep_config_kpc_map = record_kpc_map;
+
+	atexit(write_trace);
+}
+
+static void stop_recording(const char *reason)
+{
+	if (!trace.recording)
+		return;
+	kpc_get_thread_counters = recorded_kpc_get_thread_counters;
+	kpep_config_kpc_classes = recorded_kpep_config_kpc_classes;
+	kpep_config_kpc_map = recorded_kpep_config_kpc_map;
+	trace.recording = false;
+	fprintf(stderr,
+		"simple_kpc: stopped recording trace %s, since %s; it will "
+		"only replay up to here\n",
+		trace.path, reason);
+}
+
+// Replay stands in for every kpc and kpep function. kpep objects are opaque to
+// the library, so one dummy object serves as database, config and event.
+static char replay_object;
+
+static int replay_set_counting(u32 classes)
+{
+	(void)classes;
+	return 0;
+}
+
+static int replay_set_config(u32 classes, u64 *config)
+{
+	(void)classes;
+	(void)config;
+	return 0;
+}
+
+static int replay_thread_counters(u32 tid, u32 buf_count, u64 *buf)
+{
+	(void)tid;
+	usize n = 0;
+	const u64 *values = trace_next(TRACE_READ, &n);
+	for (usize i = 0; i < buf_count; i++)
+		buf[i] = i < n ? values[i] : 0;
+	return 0;
+}
+
+static int replay_force_all_ctrs_set(int val)
+{
+	(void)val;
+	return 0;
+}
+
+static int replay_force_all_ctrs_get(int *val_out)
+{
+	if (val_out)
+		*val_out = 1;
+	return 0;
+}
+
+static int replay_config_create(kpep_db *db, kpep_config **cfg_ptr)
+{
+	(void)db;
+	*cfg_ptr = (kpep_config *)&replay_object;
+	return 0;
+}
+
+static void replay_config_free(kpep_config *cfg)
+{
+	(void)cfg;
+}
+
+static int replay_config_add_event(kpep_config *cfg, kpep_event **ev_ptr,
+				   u32 flag, u32 *err)
+{
+	(void)cfg;
+	(void)ev_ptr;
+	(void)flag;
+	(void)err;
+	return 0;
+}
+
+static int replay_config_force_counters(kpep_config *cfg)
+{
+	(void)cfg;
+	return 0;
+}
+
+static int replay_config_kpc(kpep_config *cfg, u64 *buf, usize buf_size)
+{
+	(void)cfg;
+	memset(buf, 0, buf_size);
+	return 0;
+}
+
+static int replay_config_kpc_classes(kpep_config *cfg, u32 *classes_ptr)
+{
+	(void)cfg;
+	usize n = 0;
+	*classes_ptr = (u32)trace_next(TRACE_CLASSES, &n)[0];
+	return 0;
+}
+
+static int replay_config_kpc_map(kpep_config *cfg, usize *buf, usize buf_size)
+{
+	(void)cfg;
+	usize n = 0;
+	const u64 *map = trace_next(TRACE_MAP, &n);
+	for (usize i = 0; i < buf_size / sizeof(usize); i++)
+		buf[i] = i < n ? map[i] : 0;
+	return 0;
+}
+
+static int replay_db_create(const char *name, kpep_db **db_ptr)
+{
+	(void)name;
+	*db_ptr = (kpep_db *)&replay_object;
+	return 0;
+}
+
+static void replay_db_free(kpep_db *db)
+{
+	(void)db;
+}
+
+static int replay_db_event(kpep_db *db, const char *name, kpep_event **ev_ptr)
+{
+	(void)db;
+	(void)name;
+	*ev_ptr = (kpep_event *)&replay_object;
+	return 0;
+}
+
+static void start_replay(const char *path)
+{
+	read_trace(path);
+	trace.replaying = true;
+
+	kpc_set_counting = replay_set_counting;
+	kpc_set_thread_counting = replay_set_counting;
+	kpc_set_config = replay_set_config;
+	kpc_get_thread_counters = replay_thread_counters;
+	kpc_force_all_ctrs_set = replay_force_all_ctrs_set;
+	kpc_force_all_ctrs_get = replay_force_all_ctrs_get;
+
+	kpep_config_create = replay_config_create;
+	kpep_config_free = replay_config_free;
+	kpep_config_add_event = replay_config_add_event;
+	kpep_config_force_counters = replay_config_force_counters;
+	kpep_config_kpc = replay_config_kpc;
+	kpep_config_kpc_classes = replay_config_kpc_classes;
+	kpep_config_kpc_map = replay_config_kpc_map;
+	kpep_db_create = replay_db_create;
+	kpep_db_free = replay_db_free;
+	kpep_db_event = replay_db_event;
+}
+
+// Degraded counting, for processes kpc won’t let configure counters. The kpep
+// database still resolves (and so validates) event names, but compile skips
+// kpep configs: each event gets the next counter, and its register value
+// names what stands in for it, which the kpc replacements below read back.
+// On macOS, proc_pid_rusage has cycles and instructions for the whole
+// process without privileges; elsewhere cycles fall back to thread CPU time.
+
+static bool degraded = false;
+
+typedef enum {
+	STAND_IN_NONE,
+	STAND_IN_CYCLES,
+	STAND_IN_INSTRUCTIONS,
+} stand_in;
+
+static stand_in degraded_config[KPC_MAX_COUNTERS];
+
+static u64 thread_cpu_ns(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+	return (u64)ts.tv_sec * 1000000000 + (u64)ts.tv_nsec;
+}
+
+static int degraded_set_counting(u32 classes)
+{
+	(void)classes;
+	return 0;
+}
+
+static int degraded_set_config(u32 classes, u64 *config)
+{
+	(void)classes;
+	for (usize i = 0; i < KPC_MAX_COUNTERS; i++)
+		degraded_config[i] = (stand_in)config[i];
+	return 0;
+}
+
+static int degraded_thread_counters(u32 tid, u32 buf_count, u64 *buf)
+{
+	(void)tid;
+	u64 cycles = 0;
+	u64 instructions = 0;
+#ifdef __APPLE__
+	struct rusage_info_v4 usage;
+	if (proc_pid_rusage(getpid(), RUSAGE_INFO_V4,
+			    (rusage_info_t *)&usage) == 0) {
+		cycles = usage.ri_cycles;
+		instructions = usage.ri_instructions;
+	}
+#else
+	cycles = thread_cpu_ns();
+#endif
+
+	for (usize i = 0; i < buf_count; i++) {
+		stand_in s = i < KPC_MAX_COUNTERS ? degraded_config[i]
+						 : STAND_IN_NONE;
+		buf[i] = s == STAND_IN_CYCLES	     ? cycles
+			 : s == STAND_IN_INSTRUCTIONS ? instructions
+						      : 0;
+	}
+	return 0;
+}
+
+static int degraded_force_all_ctrs_set(int val)
+{
+	(void)val;
+	return 0;
+}
+
+static void start_degraded(void)
+{
+	degraded = true;
+	kpc_set_counting = degraded_set_counting;
+	kpc_set_thread_counting = degraded_set_counting;
+	kpc_set_config = degraded_set_config;
+	kpc_get_thread_counters = degraded_thread_counters;
+	kpc_force_all_ctrs_set = degraded_force_all_ctrs_set;
+}
 
 static bool initialized = false;
 
+// Host metadata, gathered once by sk_init so results from different machines
+// (or the same machine in a different state) can be told apart. Anything that
+// can’t be found is left empty, or -1 for numbers.
+
+static sk_host host;
+
+#ifdef __APPLE__
+static usize sysctl_usize(const char *name)
+{
+	// Some of these are 32-bit, which land in the low half on every Mac.
+	u64 value = 0;
+	usize size = sizeof(value);
+	if (sysctlbyname(name, &value, &size, NULL, 0) != 0)
+		return 0;
+	return (usize)value;
+}
+
+static void sysctl_string(const char *name, char *out, usize capacity)
+{
+	usize size = capacity;
+	if (sysctlbyname(name, out, &size, NULL, 0) != 0)
+		out[0] = '\0';
+	out[capacity - 1] = '\0';
+}
+#else
+// Reads the first line of a file, without its newline.
+static bool read_line(const char *path, char *out, usize capacity)
+{
+	out[0] = '\0';
+	FILE *f = fopen(path, "r");
+	if (!f)
+		return false;
+	bool ok = fgets(out, (int)capacity, f) != NULL;
+	fclose(f);
+	out[strcspn(out, "\n")] = '\0';
+	return ok;
+}
+
+static int read_int(const char *path)
+{
+	char text[32];
+	if (!read_line(path, text, sizeof(text)))
+		return -1;
+	return atoi(text);
+}
+
+// Copies the value of the first “key : value” line in /proc/cpuinfo whose
+// key is key.
+static void cpuinfo_field(const char *key, char *out, usize capacity)
+{
+	out[0] = '\0';
+	FILE *f = fopen("/proc/cpuinfo", "r");
+	if (!f)
+		return;
+	char line[4096];
+	usize key_length = strlen(key);
+	while (fgets(line, sizeof(line), f)) {
+		if (strncmp(line, key, key_length) != 0 ||
+		    (line[key_length] != ' ' && line[key_length] != '\t' &&
+		     line[key_length] != ':'))
+			continue;
+		char *value = strchr(line, ':');
+		if (!value)
+			continue;
+		value += 1 + strspn(value + 1, " \t");
+		value[strcspn(value, "\n")] = '\0';
+		snprintf(out, capacity, "%s", value);
+		break;
+	}
+	fclose(f);
+}
+#endif
+
+// Core types. Hybrid parts have a PMU per kind of core, and kpc’s thread
+// counters keep counting with whichever one the thread lands on, so counts
+// from a thread that moved between kinds mix two PMUs’ views of the same
+// events. Linux lists each hybrid PMU (cpu_core and cpu_atom on Intel, one
+// per cluster on Arm) in sysfs with the CPUs it covers; SK_SYSFS_PATH points
+// elsewhere than /sys, say at a fixture. macOS only reports how many CPUs
+// each performance level has, and lets no one ask which CPU a thread is on,
+// so there core types are listed but never attributed.
+
+#define MAX_CPUS 1024
+
+static i8 cpu_core_types[MAX_CPUS];
+
+static int current_cpu(void)
+{
+#ifdef __linux__
+	return sched_getcpu();
+#else
+	return -1;
+#endif
+}
+
+static int core_type_of(int cpu)
+{
+	if (cpu < 0 || cpu >= MAX_CPUS)
+		return -1;
+	return cpu_core_types[cpu];
+}
+
+#ifndef __APPLE__
+// Parses a CPU list such as “0-7,16-23”, assigning each CPU to type.
+static int assign_cpu_list(const char *list, int type)
+{
+	int count = 0;
+	while (*list) {
+		char *end;
+		long first = strtol(list, &end, 10);
+		if (end == list)
+			break;
+		long last = first;
+		if (*end == '-')
+			last = strtol(end + 1, &end, 10);
+		for (long cpu = first; cpu <= last; cpu++) {
+			if (cpu >= 0 && cpu < MAX_CPUS)
+				cpu_core_types[cpu] = (i8)type;
+			count++;
+		}
+		list = *end == ',' ? end + 1 : end;
+	}
+	return count;
+}
+#endif
+
+static void gather_core_types(void)
+{
+	memset(cpu_core_types, -1, sizeof(cpu_core_types));
+	host.core_type_count = 0;
+
+#ifdef __APPLE__
+	usize levels = sysctl_usize("hw.nperflevels");
+	for (usize i = 0; i < levels && i < SK_MAX_CORE_TYPES; i++) {
+		char key[64];
+		snprintf(key, sizeof(key), "hw.perflevel%zu.name", i);
+		sysctl_string(key, host.core_types[i].name,
+			      sizeof(host.core_types[i].name));
+		snprintf(key, sizeof(key), "hw.perflevel%zu.logicalcpu", i);
+		host.core_types[i].cpus = (int)sysctl_usize(key);
+		host.core_type_count++;
+	}
+#else
+	const char *sysfs = path_from_env("SK_SYSFS_PATH", "/sys");
+	char path[512];
+	snprintf(path, sizeof(path), "%s/bus/event_source/devices", sysfs);
+	struct dirent **entries = NULL;
+	int entry_count = scandir(path, &entries, NULL, alphasort);
+
+	// Hybrid PMUs have a cpus file and the plain “cpu” PMU doesn’t, but
+	// some single-PMU machines (arm64’s armv8_pmuv3_0, say) have one too,
+	// so it takes two to be hybrid. Sorting keeps the type numbers stable.
+	for (int i = 0; i < entry_count; i++) {
+		const char *name = entries[i]->d_name;
+		char list[256];
+		snprintf(path, sizeof(path),
+			 "%s/bus/event_source/devices/%s/cpus", sysfs, name);
+		if (name[0] == '.' || host.core_type_count == SK_MAX_CORE_TYPES ||
+		    !read_line(path, list, sizeof(list)))
+			continue;
+
+		usize type = host.core_type_count++;
+		snprintf(host.core_types[type].name,
+			 sizeof(host.core_types[type].name), "%.31s", name);
+		host.core_types[type].cpus = assign_cpu_list(list, (int)type);
+	}
+	for (int i = 0; i < entry_count; i++)
+		free(entries[i]);
+	free(entries);
+#endif
+
+	if (host.core_type_count < 2) {
+		memset(cpu_core_types, -1, sizeof(cpu_core_types));
+		memset(host.core_types, 0, sizeof(host.core_types));
+		host.core_type_count = 0;
+	}
+}
+
+int sk_current_core_type(void)
+{
+	return core_type_of(current_cpu());
+}
+
+static void gather_host(const char *backend)
+{
+	host = (sk_host){
+		.physical_cores = -1,
+		.logical_cores = -1,
+		.smt = -1,
+		.turbo = -1,
+		.perf_event_paranoid = -1,
+		.virtualized = -1,
+	};
+	snprintf(host.backend, sizeof(host.backend), "%s", backend);
+
+#ifdef __APPLE__
+	sysctl_string("machdep.cpu.brand_string", host.cpu_model,
+		      sizeof(host.cpu_model));
+	usize microcode = sysctl_usize("machdep.cpu.microcode_version");
+	if (microcode)
+		snprintf(host.microcode, sizeof(host.microcode), "0x%zx",
+			 microcode);
+	host.physical_cores = (int)sysctl_usize("hw.physicalcpu");
+	host.logical_cores = (int)sysctl_usize("hw.logicalcpu");
+	host.smt = host.logical_cores > host.physical_cores;
+	host.nominal_ghz = (double)sysctl_usize("hw.cpufrequency") / 1e9;
+	char release[64];
+	sysctl_string("kern.osrelease", release, sizeof(release));
+	snprintf(host.kernel, sizeof(host.kernel), "Darwin %s", release);
+	// kern.hv_vmm_present only exists on recent releases, hence the check.
+	int vmm = 0;
+	usize size = sizeof(vmm);
+	if (sysctlbyname("kern.hv_vmm_present", &vmm, &size, NULL, 0) == 0)
+		host.virtualized = vmm != 0;
+#else
+	cpuinfo_field("model name", host.cpu_model, sizeof(host.cpu_model));
+	if (!host.cpu_model[0])
+		cpuinfo_field("Model", host.cpu_model, sizeof(host.cpu_model));
+	cpuinfo_field("microcode", host.microcode, sizeof(host.microcode));
+
+	host.logical_cores = (int)sysconf(_SC_NPROCESSORS_ONLN);
+	host.smt = read_int("/sys/devices/system/cpu/smt/active");
+	char siblings[64];
+	if (read_line("/sys/devices/system/cpu/cpu0/topology/"
+		      "thread_siblings_list",
+		      siblings, sizeof(siblings))) {
+		// “0-1” or “0,4” mean two threads per core, “0” one.
+		int threads = strpbrk(siblings, ",-") ? 2 : 1;
+		host.physical_cores = host.logical_cores / threads;
+		if (host.smt < 0)
+			host.smt = threads > 1;
+	}
+
+	read_line("/sys/devices/system/cpu/cpu0/cpufreq/scaling_governor",
+		  host.governor, sizeof(host.governor));
+	int base_khz = read_int("/sys/devices/system/cpu/cpu0/cpufreq/"
+				"base_frequency");
+	if (base_khz > 0)
+		host.nominal_ghz = base_khz / 1e6;
+	int no_turbo = read_int("/sys/devices/system/cpu/intel_pstate/no_turbo");
+	if (no_turbo >= 0)
+		host.turbo = !no_turbo;
+	else
+		host.turbo = read_int("/sys/devices/system/cpu/cpufreq/boost");
+
+	struct utsname name;
+	if (uname(&name) == 0)
+		snprintf(host.kernel, sizeof(host.kernel), "%s %s",
+			 name.sysname, name.release);
+	host.perf_event_paranoid =
+		read_int("/proc/sys/kernel/perf_event_paranoid");
+
+	char flags[4096];
+	cpuinfo_field("flags", flags, sizeof(flags));
+	if (flags[0])
+		host.virtualized = strstr(flags, " hypervisor") != NULL;
+#endif
+
+	// Intel brand strings end in the nominal frequency, as in “@ 2.40GHz”.
+	const char *at = strstr(host.cpu_model, "@ ");
+	if (host.nominal_ghz <= 0 && at)
+		host.nominal_ghz = strtod(at + 2, NULL);
+
+	gather_core_types();
+}
+
+const sk_host *sk_host_get(void)
+{
+	assert(initialized);
+	return &host;
+}
+
+static const char *or_unknown(const char *s)
+{
+	return s[0] ? s : "unknown";
+}
+
+static const char *tristate(int value, const char *yes, const char *no)
+{
+	if (value < 0)
+		return "unknown";
+	return value ? yes : no;
+}
+
+// One “key: value” line per field, each starting with prefix.
+static void write_host(FILE *f, const char *prefix, const sk_host *h)
+{
+	fprintf(f, "%scpu: %s\n", prefix, or_unknown(h->cpu_model));
+	fprintf(f, "%smicrocode: %s\n", prefix, or_unknown(h->microcode));
+	fprintf(f, "%scores: %d physical, %d logical\n", prefix,
+		h->physical_cores, h->logical_cores);
+	fprintf(f, "%ssmt: %s\n", prefix, tristate(h->smt, "on", "off"));
+	fprintf(f, "%sgovernor: %s\n", prefix, or_unknown(h->governor));
+	if (h->nominal_ghz > 0)
+		fprintf(f, "%snominal frequency: %.2f GHz\n", prefix,
+			h->nominal_ghz);
+	else
+		fprintf(f, "%snominal frequency: unknown\n", prefix);
+	fprintf(f, "%sturbo: %s\n", prefix,
+		tristate(h->turbo, "enabled", "disabled"));
+	fprintf(f, "%skernel: %s\n", prefix, or_unknown(h->kernel));
+	fprintf(f, "%sperf_event_paranoid: %d\n", prefix,
+		h->perf_event_paranoid);
+	fprintf(f, "%sbackend: %s\n", prefix, h->backend);
+	fprintf(f, "%svirtualized: %s\n", prefix,
+		tristate(h->virtualized, "yes", "no"));
+	for (usize i = 0; i < h->core_type_count; i++)
+		fprintf(f, "%score type %zu: %s, %d CPUs\n", prefix, i,
+			h->core_types[i].name, h->core_types[i].cpus);
+}
+
+void sk_host_print(const sk_host *h)
+{
+	printf("\033[1m=== simple-kpc host ===\033[m\n\n");
+	write_host(stdout, "", h);
+}
+
+
 void sk_init(void)
 {
 	if (initialized)
 		return;
 
-	void *kperf = dlopen(KPERF_PATH, RTLD_LAZY);
+	const char *replay_path = getenv("SK_REPLAY");
+	if (replay_path && *replay_path) {
+		start_replay(replay_path);
+		gather_host("replay");
+		initialized = true;
+		return;
+	}
+
+	void *kperf = dlopen(path_from_env("SK_KPERF_PATH", KPERF_PATH),
+			     RTLD_LAZY);
 	if (!kperf) {
 		fprintf(stderr,
 			"simple_kpc: failed to load kperf.framework, message: "
@@ -91,7 +934,8 @@ void sk_init(void)
 		exit(1);
 	}
 
-	void *kperfdata = dlopen(KPERFDATA_PATH, RTLD_LAZY);
+	void *kperfdata = dlopen(
+		path_from_env("SK_KPERFDATA_PATH", KPERFDATA_PATH), RTLD_LAZY);
 	if (!kperfdata) {
 		fprintf(stderr,
 			"simple_kpc: failed to load kperfdata.framework, "
@@ -127,68 +971,256 @@ void sk_init(void)
 	}
 
 	if (kpc_force_all_ctrs_get(NULL) != 0) {
+		const char *require = getenv("SK_REQUIRE_COUNTERS");
+		if (require && *require && *require != '0') {
+			fprintf(stderr, "simple_kpc: permission denied, "
+					"xnu/kpc requires root privileges\n");
+			exit(1);
+		}
 		fprintf(stderr, "simple_kpc: permission denied, xnu/kpc "
-				"requires root privileges\n");
-		exit(1);
+				"requires root privileges; counting what is "
+				"available without them\n");
+		start_degraded();
 	}
 
+	const char *record_path = getenv("SK_RECORD");
+	if (record_path && *record_path && degraded)
+		fprintf(stderr, "simple_kpc: ignoring SK_RECORD, since "
+				"degraded counts can’t be replayed\n");
+	else if (record_path && *record_path)
+		start_recording(record_path);
+
+	char backend[sizeof(host.backend)];
+	snprintf(backend, sizeof(backend), "%s%s",
+		 path_from_env("SK_KPERF_PATH", KPERF_PATH),
+		 degraded ? " (degraded, no root)" : "");
+	gather_host(backend);
 	initialized = true;
 }
 
 struct sk_events {
-	const char **human_readable_names;
-	const char **internal_names;
+	// Every name passed to sk_events_push is copied into this arena, so
+	// callers can free their strings as soon as the push returns. Names are
+	// referred to by offset since the arena moves whenever it grows.
+	char *arena;
+	usize arena_length;
+	usize arena_capacity;
+
+	// One entry per call to sk_events_push, in push order.
+	usize *human_readable_names;
+	usize *internal_names;
+	usize *event_indices; // push -> index into unique_events
 	usize count;
+	usize capacity;
+
+	// Distinct internal names in first-seen order. Only these are
+	// programmed, so pushing the same event twice costs one counter.
+	usize *unique_events;
+	usize unique_count;
+
+	// kpep output for unique_events, built on first use and reused by every
+	// measurement until the next push.
+	bool compiled;
+	u32 classes;
+	usize counter_map[KPC_MAX_COUNTERS];
+	u64 regs[KPC_MAX_COUNTERS];
+
+	// With split_modes, every unique event is added a second time counting
+	// user space only, at user_counter_map.
+	bool split_modes;
+	usize user_counter_map[KPC_MAX_COUNTERS];
 };
 
-sk_events *sk_events_create(void)
+// unique_count never exceeds count, so all four per-push arrays can share one
+// capacity.
+static void reserve_pushes(sk_events *e, usize needed)
 {
-	sk_events *e = calloc(1, sizeof(sk_events));
-	*e = (sk_events){
-		.human_readable_names =
-			calloc(KPC_MAX_COUNTERS, sizeof(const char *)),
-		.internal_names =
-			calloc(KPC_MAX_COUNTERS, sizeof(const char *)),
-		.count = 0,
-	};
-	return e;
+	if (needed <= e->capacity)
+		return;
+
+	usize capacity = grown_capacity(e->capacity, needed);
+	usize size = capacity * sizeof(usize);
+	e->human_readable_names = xrealloc(e->human_readable_names, size);
+	e->internal_names = xrealloc(e->internal_names, size);
+	e->event_indices = xrealloc(e->event_indices, size);
+	e->unique_events = xrealloc(e->unique_events, size);
+	e->capacity = capacity;
 }
 
-void sk_events_push(sk_events *e, const char *human_readable_name,
-		    const char *internal_name)
+static const char *event_name(const sk_events *e, usize offset)
 {
-	e->human_readable_names[e->count] = human_readable_name;
-	e->internal_names[e->count] = internal_name;
-	e->count++;
+	return e->arena + offset;
 }
 
-void sk_events_destroy(sk_events *e)
+// Display name for distinct event j: the name it was first pushed under.
+static const char *unique_event_name(const sk_events *e, usize j)
 {
-	free(e->human_readable_names);
-	free(e->internal_names);
-	free(e);
+	usize i = 0;
+	while (e->event_indices[i] != j)
+		i++;
+	return event_name(e, e->human_readable_names[i]);
 }
 
-struct sk_in_progress_measurement {
-	sk_events *events;
-	u32 classes;
-	usize counter_map[KPC_MAX_COUNTERS];
-	u64 regs[KPC_MAX_COUNTERS];
-	u64 counters[KPC_MAX_COUNTERS];
+// kpep databases name the fixed counters differently on Apple Silicon and
+// Intel, so derived metrics look for any of these.
+static const char *const CYCLES_EVENTS[] = {
+	"FIXED_CYCLES",
+	"CPU_CLK_UNHALTED.THREAD",
+	"CPU_CLK_UNHALTED.CORE",
+	NULL,
 };
 
-sk_in_progress_measurement *sk_start_measurement(sk_events *e)
+static const char *const INSTRUCTIONS_EVENTS[] = {
+	"FIXED_INSTRUCTIONS",
+	"INST_RETIRED.ANY",
+	NULL,
+};
+
+// Finds the distinct event whose internal name is one of names.
+static bool find_event(const sk_events *e, const char *const *names,
+		       usize *index)
+{
+	for (usize j = 0; j < e->unique_count; j++) {
+		for (const char *const *name = names; *name; name++) {
+			if (strcmp(event_name(e, e->unique_events[j]), *name) ==
+			    0) {
+				*index = j;
+				return true;
+			}
+		}
+	}
+	return false;
+}
+
+static usize intern(sk_events *e, const char *name)
+{
+	// The arena is a run of NUL-terminated strings with no duplicates.
+	for (usize offset = 0; offset < e->arena_length;
+	     offset += strlen(e->arena + offset) + 1) {
+		if (strcmp(e->arena + offset, name) == 0)
+			return offset;
+	}
+
+	usize length = strlen(name) + 1;
+	if (e->arena_length + length > e->arena_capacity) {
+		e->arena_capacity = grown_capacity(e->arena_capacity,
+						   e->arena_length + length);
+		e->arena = xrealloc(e->arena, e->arena_capacity);
+	}
+	usize offset = e->arena_length;
+	memcpy(e->arena + offset, name, length);
+	e->arena_length += length;
+	return offset;
+}
+
+sk_events *sk_events_create(void)
+{
+	return calloc(1, sizeof(sk_events));
+}
+
+void sk_events_push(sk_events *e, const char *human_readable_name,
+		    const char *internal_name)
+{
+	reserve_pushes(e, e->count + 1);
+	usize human_readable = intern(e, human_readable_name);
+	usize internal = intern(e, internal_name);
+
+	// Interning gives equal names equal offsets, so no strcmp is needed.
+	usize event_index = 0;
+	while (event_index < e->unique_count &&
+	       e->unique_events[event_index] != internal)
+		event_index++;
+	if (event_index == e->unique_count)
+		e->unique_events[e->unique_count++] = internal;
+
+	e->human_readable_names[e->count] = human_readable;
+	e->internal_names[e->count] = internal;
+	e->event_indices[e->count] = event_index;
+	e->count++;
+	e->compiled = false;
+}
+
+void sk_events_destroy(sk_events *e)
+{
+	free(e->arena);
+	free(e->human_readable_names);
+	free(e->internal_names);
+	free(e->event_indices);
+	free(e->unique_events);
+	free(e);
+}
+
+static stand_in stand_in_for(const char *internal_name)
+{
+	for (const char *const *name = CYCLES_EVENTS; *name; name++)
+		if (strcmp(internal_name, *name) == 0)
+			return STAND_IN_CYCLES;
+#ifdef __APPLE__
+	for (const char *const *name = INSTRUCTIONS_EVENTS; *name; name++)
+		if (strcmp(internal_name, *name) == 0)
+			return STAND_IN_INSTRUCTIONS;
+#endif
+	return STAND_IN_NONE;
+}
+
+sk_event_source sk_events_source(const sk_events *e, size_t i)
+{
+	assert(i < e->count);
+	if (!degraded)
+		return SK_SOURCE_COUNTER;
+	switch (stand_in_for(event_name(e, e->internal_names[i]))) {
+	case STAND_IN_CYCLES:
+#ifdef __APPLE__
+		return SK_SOURCE_PROCESS;
+#else
+		return SK_SOURCE_CPU_TIME;
+#endif
+	case STAND_IN_INSTRUCTIONS:
+		return SK_SOURCE_PROCESS;
+	case STAND_IN_NONE:
+		break;
+	}
+	return SK_SOURCE_NONE;
+}
+
+static const char *source_description(sk_event_source source)
+{
+	switch (source) {
+	case SK_SOURCE_COUNTER:
+		break;
+	case SK_SOURCE_PROCESS:
+		return "counted for the whole process";
+	case SK_SOURCE_CPU_TIME:
+		return "replaced by thread CPU time in ns";
+	case SK_SOURCE_NONE:
+		return "unavailable, reads as zero";
+	}
+	return "counted";
+}
+
+static void report_degraded(const sk_events *e, usize i)
+{
+	fprintf(stderr, "simple_kpc: %s (%s): %s\n",
+		event_name(e, e->human_readable_names[i]),
+		event_name(e, e->internal_names[i]),
+		source_description(sk_events_source(e, i)));
+}
+
+static void compile(sk_events *e)
 {
 	assert(initialized);
 
-	sk_in_progress_measurement *m =
-		calloc(1, sizeof(sk_in_progress_measurement));
-	*m = (sk_in_progress_measurement){
-		.events = e,
-		.classes = 0,
-		.counter_map = { 0 },
-		.counters = { 0 },
-	};
+	if (e->compiled)
+		return;
+
+	usize programmed = e->unique_count * (e->split_modes ? 2 : 1);
+	if (programmed > KPC_MAX_COUNTERS) {
+		fprintf(stderr,
+			"simple_kpc: %zu events to program, but at most %d can "
+			"be counted at once\n",
+			programmed, KPC_MAX_COUNTERS);
+		exit(1);
+	}
 
 	kpep_db *kpep_db = NULL;
 	kpep_db_create(NULL, &kpep_db);
@@ -197,58 +1229,3250 @@ sk_in_progress_measurement *sk_start_measurement(sk_events *e)
 	kpep_config_create(kpep_db, &kpep_config);
 	kpep_config_force_counters(kpep_config);
 
-	for (usize i = 0; i < m->events->count; i++) {
-		const char *internal_name = m->events->internal_names[i];
+	e->classes = 0;
+	memset(e->counter_map, 0, sizeof(e->counter_map));
+	memset(e->user_counter_map, 0, sizeof(e->user_counter_map));
+	memset(e->regs, 0, sizeof(e->regs));
+
+	// Unique events are numbered in first-seen order, so walking the pushes
+	// and skipping repeats adds each event once, in counter_map order.
+	usize added = 0;
+	for (usize i = 0; i < e->count; i++) {
+		if (e->event_indices[i] != added)
+			continue;
+
+		const char *internal_name = event_name(e, e->internal_names[i]);
 		kpep_event *event = NULL;
 		kpep_db_event(kpep_db, internal_name, &event);
 
 		if (event == NULL) {
 			const char *human_readable_name =
-				m->events->human_readable_names[i];
+				event_name(e, e->human_readable_names[i]);
 			printf("Cannot find event for %s: “%s”.\n",
 			       human_readable_name, internal_name);
 			exit(1);
 		}
 
-		kpep_config_add_event(kpep_config, &event, 0, NULL);
+		if (degraded) {
+			stand_in s = stand_in_for(internal_name);
+			e->counter_map[added] = added;
+			e->regs[added] = s;
+			report_degraded(e, i);
+			added++;
+			continue;
+		}
+
+		if (kpep_config_add_event(kpep_config, &event, 0, NULL) != 0) {
+			printf("Cannot add event “%s”: out of counters.\n",
+			       internal_name);
+			exit(1);
+		}
+		added++;
+	}
+
+	// The user-only copies go after all the others, so the first
+	// unique_count entries of the map are the same either way.
+	for (usize j = 0; e->split_modes && !degraded && j < e->unique_count;
+	     j++) {
+		const char *internal_name = event_name(e, e->unique_events[j]);
+		kpep_event *event = NULL;
+		kpep_db_event(kpep_db, internal_name, &event);
+		if (kpep_config_add_event(kpep_config, &event, 1, NULL) != 0) {
+			printf("Cannot add user-space copy of event “%s”: out "
+			       "of counters.\n",
+			       internal_name);
+			exit(1);
+		}
 	}
 
-	kpep_config_kpc_classes(kpep_config, &m->classes);
-	kpep_config_kpc_map(kpep_config, m->counter_map,
-			    sizeof(m->counter_map));
-	kpep_config_kpc(kpep_config, m->regs, sizeof(m->regs));
+	if (!degraded) {
+		usize map[2 * KPC_MAX_COUNTERS] = { 0 };
+		kpep_config_kpc_classes(kpep_config, &e->classes);
+		kpep_config_kpc_map(kpep_config, map, sizeof(map));
+		kpep_config_kpc(kpep_config, e->regs, sizeof(e->regs));
+		for (usize j = 0; j < e->unique_count; j++) {
+			e->counter_map[j] = map[j];
+			e->user_counter_map[j] = map[e->unique_count + j];
+		}
+	}
 
 	kpep_config_free(kpep_config);
 	kpep_db_free(kpep_db);
 
+	e->compiled = true;
+}
+
+void sk_events_split_modes(sk_events *e)
+{
+	e->split_modes = true;
+	e->compiled = false;
+}
+
+size_t sk_events_count(const sk_events *e)
+{
+	return e->count;
+}
+
+size_t sk_events_counter_index(sk_events *e, size_t i)
+{
+	assert(i < e->count);
+	compile(e);
+	return e->counter_map[e->event_indices[i]];
+}
+
+void sk_events_arm(sk_events *e)
+{
+	compile(e);
 	kpc_force_all_ctrs_set(1);
-	kpc_set_config(m->classes, m->regs);
+	kpc_set_config(e->classes, e->regs);
+	kpc_set_counting(e->classes);
+	kpc_set_thread_counting(e->classes);
+}
+
+void sk_events_disarm(sk_events *e)
+{
+	(void)e;
+	kpc_set_counting(0);
+	kpc_force_all_ctrs_set(0);
+}
+
+sk_counter_reader sk_get_counter_reader(void)
+{
+	assert(initialized);
+	return kpc_get_thread_counters;
+}
+
+static u64 monotonic_ns(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (u64)ts.tv_sec * 1000000000 + (u64)ts.tv_nsec;
+}
+
+// The time at a counter read, taken right next to it so the pair brackets
+// the same span the counts do. ticks is the CPU’s own timestamp counter where
+// user space can read one: the TSC on x86, the virtual counter on arm64.
+typedef struct {
+	u64 ns;
+	u64 ticks;
+} timestamp;
+
+static inline u64 read_ticks(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+	u32 low, high;
+	__asm__ volatile("rdtsc" : "=a"(low), "=d"(high));
+	return (u64)high << 32 | low;
+#elif defined(__aarch64__)
+	u64 ticks;
+	__asm__ volatile("mrs %0, cntvct_el0" : "=r"(ticks));
+	return ticks;
+#else
+	return 0;
+#endif
+}
+
+static inline void read_timestamp(timestamp *out)
+{
+	out->ns = monotonic_ns();
+	out->ticks = read_ticks();
+}
+
+static void elapsed_between(const timestamp *before, const timestamp *after,
+			    sk_result *out)
+{
+	out->elapsed_ns = after->ns - before->ns;
+	out->elapsed_ticks = after->ticks - before->ticks;
+}
+
+// Cumulative scheduling state of the calling thread. The CPU number only
+// exists to spot migrations between two of these. Context switches are only
+// counted where getrusage can count them per thread: the whole process’s
+// would flag runs as preempted whenever any other thread was, and Mach’s
+// thread_info has no switch counts at all.
+typedef struct {
+	sk_scheduling totals;
+	int cpu;
+} scheduling_state;
+
+static void read_scheduling(scheduling_state *out)
+{
+	if (trace.replaying) {
+		usize n = 0;
+		const u64 *values = trace_next(TRACE_SCHEDULING, &n);
+		out->totals = (sk_scheduling){
+			.wall_ns = values[0],
+			.cpu_ns = values[1],
+			.voluntary_switches = values[2],
+			.involuntary_switches = values[3],
+		};
+		out->cpu = (int)(int64_t)values[4];
+		return;
+	}
+
+	out->totals = (sk_scheduling){
+		.wall_ns = monotonic_ns(),
+		.cpu_ns = thread_cpu_ns(),
+	};
+#ifdef RUSAGE_THREAD
+	struct rusage usage;
+	getrusage(RUSAGE_THREAD, &usage);
+	out->totals.voluntary_switches = (u64)usage.ru_nvcsw;
+	out->totals.involuntary_switches = (u64)usage.ru_nivcsw;
+#endif
+	out->cpu = current_cpu();
+
+	u64 values[] = {
+		out->totals.wall_ns,
+		out->totals.cpu_ns,
+		out->totals.voluntary_switches,
+		out->totals.involuntary_switches,
+		(u64)(int64_t)out->cpu,
+	};
+	trace_record(TRACE_SCHEDULING, ARRAY_LENGTH(values), values);
+}
+
+static void scheduling_delta(const scheduling_state *before,
+			     const scheduling_state *after, sk_scheduling *out)
+{
+	*out = (sk_scheduling){
+		.wall_ns = after->totals.wall_ns - before->totals.wall_ns,
+		.cpu_ns = after->totals.cpu_ns - before->totals.cpu_ns,
+		.voluntary_switches = after->totals.voluntary_switches -
+				      before->totals.voluntary_switches,
+		.involuntary_switches = after->totals.involuntary_switches -
+					before->totals.involuntary_switches,
+		.migrations = before->cpu != after->cpu,
+		.start_cpu = before->cpu,
+		.end_cpu = after->cpu,
+		.start_core_type = core_type_of(before->cpu),
+		.end_core_type = core_type_of(after->cpu),
+	};
+}
+
+// The scheduling state is read outside the counter reads, so its syscalls
+// don’t show up in the counts.
+struct sk_in_progress_measurement {
+	sk_events *events;
+	u64 counters[KPC_MAX_COUNTERS];
+	timestamp time;
+	scheduling_state scheduling;
+};
+
+sk_in_progress_measurement *sk_start_measurement(sk_events *e)
+{
+	sk_in_progress_measurement *m =
+		calloc(1, sizeof(sk_in_progress_measurement));
+	*m = (sk_in_progress_measurement){
+		.events = e,
+		.counters = { 0 },
+	};
+
+	read_scheduling(&m->scheduling);
 
 	// Don’t put any library code below these kpc calls!
-	kpc_set_counting(m->classes);
-	kpc_set_thread_counting(m->classes);
+	sk_events_arm(e);
+	read_timestamp(&m->time);
 	kpc_get_thread_counters(0, KPC_MAX_COUNTERS, m->counters);
 	return m;
 }
 
-void sk_finish_measurement(sk_in_progress_measurement *m)
+static void record(sk_events *e, const u64 *before, const u64 *after,
+		   sk_result *out)
+{
+	*out = (sk_result){ .events = e, .host = &host };
+	for (usize i = 0; i < e->unique_count; i++) {
+		usize idx = e->counter_map[i];
+		out->counts[i] = after[idx] - before[idx];
+	}
+	for (usize i = 0; e->split_modes && !degraded && i < e->unique_count;
+	     i++) {
+		usize idx = e->user_counter_map[i];
+		out->user_counts[i] = after[idx] - before[idx];
+	}
+}
+
+void sk_stop_measurement(sk_in_progress_measurement *m, sk_result *out)
 {
 	u64 counters_after[KPC_MAX_COUNTERS] = { 0 };
 
 	// Don’t put any library code above these kpc calls!
 	// We don’t want to execute anything until timing has stopped
 	kpc_get_thread_counters(0, KPC_MAX_COUNTERS, counters_after);
-	kpc_set_counting(0);
-	kpc_force_all_ctrs_set(0);
+	timestamp time_after;
+	read_timestamp(&time_after);
+	sk_events_disarm(m->events);
+	scheduling_state scheduling_after;
+	read_scheduling(&scheduling_after);
+
+	record(m->events, m->counters, counters_after, out);
+	elapsed_between(&m->time, &time_after, out);
+	scheduling_delta(&m->scheduling, &scheduling_after, &out->scheduling);
+	free(m);
+}
+
+void sk_measurement_snapshot(sk_in_progress_measurement *m, sk_result *out)
+{
+	u64 counters_now[KPC_MAX_COUNTERS] = { 0 };
+	kpc_get_thread_counters(0, KPC_MAX_COUNTERS, counters_now);
+	timestamp time_now;
+	read_timestamp(&time_now);
+	scheduling_state scheduling_now;
+	read_scheduling(&scheduling_now);
+
+	record(m->events, m->counters, counters_now, out);
+	elapsed_between(&m->time, &time_now, out);
+	scheduling_delta(&m->scheduling, &scheduling_now, &out->scheduling);
+}
+
+void sk_result_diff(const sk_result *later, const sk_result *earlier,
+		    sk_result *out)
+{
+	assert(later->events == earlier->events);
+	sk_result diff = {
+		.events = later->events,
+		.host = later->host,
+		.elapsed_ns = later->elapsed_ns - earlier->elapsed_ns,
+		.elapsed_ticks = later->elapsed_ticks - earlier->elapsed_ticks,
+	};
+	for (usize i = 0; i < later->events->unique_count; i++) {
+		diff.counts[i] = later->counts[i] - earlier->counts[i];
+		diff.user_counts[i] =
+			later->user_counts[i] - earlier->user_counts[i];
+	}
+
+	const sk_scheduling *a = &earlier->scheduling;
+	const sk_scheduling *b = &later->scheduling;
+	diff.scheduling = (sk_scheduling){
+		.wall_ns = b->wall_ns - a->wall_ns,
+		.cpu_ns = b->cpu_ns - a->cpu_ns,
+		.voluntary_switches =
+			b->voluntary_switches - a->voluntary_switches,
+		.involuntary_switches =
+			b->involuntary_switches - a->involuntary_switches,
+		.migrations = a->end_cpu != b->end_cpu,
+		.start_cpu = a->end_cpu,
+		.end_cpu = b->end_cpu,
+		.start_core_type = a->end_core_type,
+		.end_core_type = b->end_core_type,
+	};
+	*out = diff;
+}
+
+void sk_finish_measurement(sk_in_progress_measurement *m)
+{
+	sk_result result;
+	sk_stop_measurement(m, &result);
+	sk_result_print(&result);
+}
+
+uint64_t sk_result_get(const sk_result *r, size_t i)
+{
+	assert(i < r->events->count);
+	return r->counts[r->events->event_indices[i]];
+}
+
+uint64_t sk_result_get_user(const sk_result *r, size_t i)
+{
+	assert(i < r->events->count);
+	assert(r->events->split_modes);
+	return r->user_counts[r->events->event_indices[i]];
+}
+
+// The two counters are read one after the other, so an event that fired in
+// between, or one that only counts in user space anyway, can make the
+// user-space count come out ahead.
+uint64_t sk_result_get_kernel(const sk_result *r, size_t i)
+{
+	u64 all = sk_result_get(r, i);
+	u64 user = sk_result_get_user(r, i);
+	return all > user ? all - user : 0;
+}
+
+void sk_result_print(const sk_result *r)
+{
+	const sk_events *e = r->events;
 
 	printf("\033[1m=== simple-kpc report ===\033[m\n\n");
+	if (r->host)
+		printf("%s, %s%s\n\n", or_unknown(r->host->cpu_model),
+		       or_unknown(r->host->kernel),
+		       r->host->virtualized == 1 ? ", virtualized" : "");
 	setlocale(LC_NUMERIC, "");
-	for (usize i = 0; i < m->events->count; i++) {
-		const char *name = m->events->human_readable_names[i];
-		usize idx = m->counter_map[i];
-		u64 diff = counters_after[idx] - m->counters[idx];
-		printf("\033[32m%16'llu \033[95m%s\033[m\n", diff, name);
+	for (usize i = 0; i < e->count; i++) {
+		const char *name = event_name(e, e->human_readable_names[i]);
+		unsigned long long diff = sk_result_get(r, i);
+		printf("\033[32m%'16llu \033[95m%s\033[m", diff, name);
+		if (e->split_modes && !degraded)
+			printf(" (user %'llu, kernel %'llu)",
+			       (unsigned long long)sk_result_get_user(r, i),
+			       (unsigned long long)sk_result_get_kernel(r, i));
+		sk_event_source source = sk_events_source(e, i);
+		if (source != SK_SOURCE_COUNTER)
+			printf(" (%s)", source_description(source));
+		printf("\n");
 	}
 
-	free(m);
+	if (r->elapsed_ns != 0) {
+		printf("\n\033[32m%'16llu \033[95mns elapsed\033[m",
+		       (unsigned long long)r->elapsed_ns);
+		if (r->elapsed_ticks != 0)
+			printf(" (%'llu ticks)",
+			       (unsigned long long)r->elapsed_ticks);
+		printf("\n");
+		for (usize i = 0; i < e->count; i++) {
+			const char *name =
+				event_name(e, e->human_readable_names[i]);
+			printf("\033[32m%'16.0f \033[95m%s per second\033[m",
+			       sk_result_per_second(r, i), name);
+			double ns = sk_result_ns_per_event(r, i);
+			if (ns > 0)
+				printf(" (%.3g ns each)", ns);
+			printf("\n");
+		}
+	}
+
+	const sk_scheduling *s = &r->scheduling;
+	if (s->wall_ns == 0)
+		return;
+	// The CPU clock ticks more coarsely than the wall clock, so it can
+	// come out slightly ahead.
+	u64 off_cpu_ns = s->wall_ns > s->cpu_ns ? s->wall_ns - s->cpu_ns : 0;
+	printf("\n");
+	printf("\033[32m%'16llu \033[95mns wall time\033[m\n",
+	       (unsigned long long)s->wall_ns);
+	printf("\033[32m%'16llu \033[95mns on CPU\033[m\n",
+	       (unsigned long long)s->cpu_ns);
+	printf("\033[32m%'16llu \033[95mns off CPU\033[m\n",
+	       (unsigned long long)off_cpu_ns);
+	double ghz = sk_result_frequency(r);
+	if (ghz > 0)
+		printf("\033[32m%16.2f \033[95mGHz effective\033[m\n", ghz);
+#ifdef RUSAGE_THREAD
+	printf("\033[32m%'16llu \033[95mvoluntary context switches\033[m\n",
+	       (unsigned long long)s->voluntary_switches);
+	printf("\033[32m%'16llu \033[95minvoluntary context switches\033[m\n",
+	       (unsigned long long)s->involuntary_switches);
+#else
+	printf("%16s context switches aren’t counted per thread here\n", "");
+#endif
+#ifdef __linux__
+	printf("\033[32m%'16llu \033[95mCPU migrations\033[m (CPU %d → %d)\n",
+	       (unsigned long long)s->migrations, s->start_cpu, s->end_cpu);
+#endif
+	if (s->start_core_type >= 0 && s->end_core_type >= 0 && r->host)
+		printf("%16s core type %s → %s\n", "",
+		       r->host->core_types[s->start_core_type].name,
+		       r->host->core_types[s->end_core_type].name);
+
+	unsigned disturbances = sk_result_disturbances(r);
+	if (disturbances)
+		printf("\n\033[31mdisturbed:%s%s%s\033[m\n",
+		       disturbances & SK_DISTURBED_PREEMPTED ? " preempted" : "",
+		       disturbances & SK_DISTURBED_MIGRATED ? " migrated" : "",
+		       disturbances & SK_DISTURBED_CORE_TYPE
+			       ? " across core types"
+			       : "");
+}
+
+double sk_result_per_second(const sk_result *r, size_t i)
+{
+	if (r->elapsed_ns == 0)
+		return 0;
+	return (double)sk_result_get(r, i) * 1e9 / (double)r->elapsed_ns;
+}
+
+double sk_result_ns_per_event(const sk_result *r, size_t i)
+{
+	u64 count = sk_result_get(r, i);
+	if (count == 0)
+		return 0;
+	return (double)r->elapsed_ns / (double)count;
+}
+
+// Cycles per nanosecond on the CPU. Only real cycle counts will do: the
+// degraded stand-in for cycles is CPU time itself.
+static double effective_ghz(const sk_events *e, const u64 *counts, u64 cpu_ns)
+{
+	usize cycles;
+	if (cpu_ns == 0 || degraded || !find_event(e, CYCLES_EVENTS, &cycles))
+		return 0;
+	return (double)counts[cycles] / (double)cpu_ns;
+}
+
+double sk_result_frequency(const sk_result *r)
+{
+	return effective_ghz(r->events, r->counts, r->scheduling.cpu_ns);
+}
+
+void sk_result_normalize_frequency(const sk_result *r, double nominal_ghz,
+				   sk_result *out)
+{
+	const sk_events *e = r->events;
+	if (nominal_ghz <= 0 && r->host)
+		nominal_ghz = r->host->nominal_ghz;
+	*out = *r;
+
+	double ghz = sk_result_frequency(r);
+	if (ghz <= 0 || nominal_ghz <= 0)
+		return;
+	for (usize j = 0; j < e->unique_count; j++) {
+		const char *name = event_name(e, e->unique_events[j]);
+		for (const char *const *n = CYCLES_EVENTS; *n; n++) {
+			if (strcmp(name, *n) == 0)
+				out->counts[j] = (u64)llround(
+					(double)r->counts[j] * nominal_ghz /
+					ghz);
+		}
+	}
+}
+
+unsigned sk_result_disturbances(const sk_result *r)
+{
+	unsigned disturbances = 0;
+	if (r->scheduling.involuntary_switches)
+		disturbances |= SK_DISTURBED_PREEMPTED;
+	if (r->scheduling.migrations)
+		disturbances |= SK_DISTURBED_MIGRATED;
+	if (r->scheduling.start_core_type >= 0 &&
+	    r->scheduling.end_core_type >= 0 &&
+	    r->scheduling.start_core_type != r->scheduling.end_core_type)
+		disturbances |= SK_DISTURBED_CORE_TYPE;
+	return disturbances;
+}
+
+// Runs f once between two counter reads; e must already be armed.
+static void measure_call(sk_events *e, sk_callback f, void *context,
+			 sk_result *out)
+{
+	u64 before[KPC_MAX_COUNTERS] = { 0 };
+	u64 after[KPC_MAX_COUNTERS] = { 0 };
+	timestamp time_before;
+	timestamp time_after;
+	scheduling_state scheduling_before;
+	scheduling_state scheduling_after;
+
+	read_scheduling(&scheduling_before);
+	read_timestamp(&time_before);
+	kpc_get_thread_counters(0, KPC_MAX_COUNTERS, before);
+	f(context);
+	kpc_get_thread_counters(0, KPC_MAX_COUNTERS, after);
+	read_timestamp(&time_after);
+	read_scheduling(&scheduling_after);
+
+	record(e, before, after, out);
+	elapsed_between(&time_before, &time_after, out);
+	scheduling_delta(&scheduling_before, &scheduling_after,
+			 &out->scheduling);
+}
+
+static const char *const REF_CYCLES_EVENTS[] = {
+	"CPU_CLK_UNHALTED.REF_TSC",
+	"CPU_CLK_UNHALTED.REF",
+	"CPU_CLK_UNHALTED.REF_XCLK",
+	NULL,
+};
+
+// Reruns disturbed calls for the repeated-run harnesses. Apple’s PMUs have no
+// reference cycles counter, so frequency is only checked on Intel, against
+// the cycles per reference cycle of the first clean run.
+#define FREQUENCY_TOLERANCE 0.05
+
+typedef struct {
+	bool has_ratio;
+	usize cycles;
+	usize ref_cycles;
+	double ratio; // zero until the first clean run
+	usize discarded;
+} noise_filter;
+
+static noise_filter noise_filter_create(const sk_events *e)
+{
+	noise_filter nf = { 0 };
+	nf.has_ratio = find_event(e, CYCLES_EVENTS, &nf.cycles) &&
+		       find_event(e, REF_CYCLES_EVENTS, &nf.ref_cycles);
+	return nf;
+}
+
+static unsigned run_disturbances(noise_filter *nf, const sk_result *r)
+{
+	unsigned disturbances = sk_result_disturbances(r);
+	if (disturbances || !nf->has_ratio || r->counts[nf->ref_cycles] == 0)
+		return disturbances;
+
+	double ratio = (double)r->counts[nf->cycles] /
+		       (double)r->counts[nf->ref_cycles];
+	if (nf->ratio == 0)
+		nf->ratio = ratio;
+	else if (fabs(ratio / nf->ratio - 1) > FREQUENCY_TOLERANCE)
+		disturbances |= SK_DISTURBED_FREQUENCY;
+	return disturbances;
+}
+
+// prepare, if given, runs untimed before every attempt, for state that a
+// disturbed attempt would otherwise leave behind (such as warm caches).
+static void measure_prepared_call(noise_filter *nf, sk_events *e,
+				  sk_callback prepare, void *prepare_context,
+				  sk_callback f, void *context, sk_result *out)
+{
+	for (usize attempt = 0;; attempt++) {
+		if (prepare)
+			prepare(prepare_context);
+		measure_call(e, f, context, out);
+		if (!run_disturbances(nf, out) ||
+		    attempt == SK_MAX_DISTURBED_RETRIES)
+			return;
+		nf->discarded++;
+	}
+}
+
+static void measure_clean_call(noise_filter *nf, sk_events *e, sk_callback f,
+			       void *context, sk_result *out)
+{
+	measure_prepared_call(nf, e, NULL, NULL, f, context, out);
+}
+
+// splitmix64. Only used to shuffle run orders and draw resamples, so seeding
+// it from the clock is plenty, as long as replays get the recorded seed back.
+static u64 harness_seed(void)
+{
+	if (trace.replaying) {
+		usize n = 0;
+		return trace_next(TRACE_SEED, &n)[0];
+	}
+	u64 seed = monotonic_ns();
+	trace_record(TRACE_SEED, 1, &seed);
+	return seed;
+}
+
+static u64 next_random(u64 *state)
+{
+	u64 z = (*state += 0x9e3779b97f4a7c15);
+	z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9;
+	z = (z ^ (z >> 27)) * 0x94d049bb133111eb;
+	return z ^ (z >> 31);
+}
+
+
+static int compare_doubles(const void *a, const void *b)
+{
+	double x = *(const double *)a;
+	double y = *(const double *)b;
+	return (x > y) - (x < y);
+}
+
+// Sorts xs in place.
+static double median(double *xs, usize n)
+{
+	qsort(xs, n, sizeof(double), compare_doubles);
+	if (n % 2)
+		return xs[n / 2];
+	return (xs[n / 2 - 1] + xs[n / 2]) / 2;
+}
+
+static double relative_change(double a, double b)
+{
+	// Events that never fire (say, branch misses in a loop with no
+	// branches) would otherwise divide by zero.
+	return (b - a) / fmax(a, 1);
+}
+
+typedef struct {
+	double value;
+	bool from_a;
+} ranked_sample;
+
+static int compare_ranked_samples(const void *a, const void *b)
+{
+	return compare_doubles(&((const ranked_sample *)a)->value,
+			       &((const ranked_sample *)b)->value);
+}
+
+// Two-sided Mann-Whitney U test using the normal approximation with tie and
+// continuity corrections, which is accurate from about ten runs per side.
+static double mann_whitney_p(const double *a, const double *b, usize n)
+{
+	usize total = 2 * n;
+	ranked_sample *all = calloc(total, sizeof(ranked_sample));
+	for (usize i = 0; i < n; i++) {
+		all[i] = (ranked_sample){ .value = a[i], .from_a = true };
+		all[n + i] = (ranked_sample){ .value = b[i], .from_a = false };
+	}
+	qsort(all, total, sizeof(ranked_sample), compare_ranked_samples);
+
+	double rank_sum_a = 0;
+	double ties = 0;
+	for (usize i = 0; i < total;) {
+		usize j = i;
+		while (j < total && all[j].value == all[i].value)
+			j++;
+
+		// Tied samples share the mean of the ranks i + 1 through j.
+		double rank = (double)(i + 1 + j) / 2;
+		for (usize k = i; k < j; k++) {
+			if (all[k].from_a)
+				rank_sum_a += rank;
+		}
+
+		double t = (double)(j - i);
+		ties += t * t * t - t;
+		i = j;
+	}
+	free(all);
+
+	double nn = (double)n;
+	double u = rank_sum_a - nn * (nn + 1) / 2;
+	double mean = nn * nn / 2;
+	double variance = nn * nn / 12 *
+			  ((double)total + 1 - ties / ((double)total * (total - 1)));
+	if (variance <= 0)
+		return 1;
+
+	double z = fmax(fabs(u - mean) - 0.5, 0) / sqrt(variance);
+	return erfc(z / sqrt(2));
+}
+
+#define BOOTSTRAP_RESAMPLES 2000
+
+// 95% percentile-bootstrap interval for the relative change in medians.
+static void bootstrap_change(const double *a, const double *b, usize n,
+			     u64 *rng, double *low, double *high)
+{
+	double *changes = calloc(BOOTSTRAP_RESAMPLES, sizeof(double));
+	double *resample_a = calloc(n, sizeof(double));
+	double *resample_b = calloc(n, sizeof(double));
+
+	for (usize r = 0; r < BOOTSTRAP_RESAMPLES; r++) {
+		for (usize i = 0; i < n; i++) {
+			resample_a[i] = a[next_random(rng) % n];
+			resample_b[i] = b[next_random(rng) % n];
+		}
+		changes[r] = relative_change(median(resample_a, n),
+					     median(resample_b, n));
+	}
+
+	qsort(changes, BOOTSTRAP_RESAMPLES, sizeof(double), compare_doubles);
+	*low = changes[BOOTSTRAP_RESAMPLES * 25 / 1000];
+	*high = changes[BOOTSTRAP_RESAMPLES * 975 / 1000 - 1];
+
+	free(changes);
+	free(resample_a);
+	free(resample_b);
+}
+
+struct sk_comparison {
+	sk_events *events;
+	usize runs;
+	usize discarded;
+	const char *label_a;
+	const char *label_b;
+	sk_event_comparison *events_compared; // per distinct event
+};
+
+// Compares two sets of runs event by event; takes ownership of the results.
+static sk_comparison *summarize_comparison(sk_events *e, usize runs,
+					   sk_result *results_a,
+					   sk_result *results_b, u64 *rng)
+{
+	usize event_count = e->unique_count;
+	sk_comparison *c = calloc(1, sizeof(sk_comparison));
+	*c = (sk_comparison){
+		.events = e,
+		.runs = runs,
+		.label_a = "A",
+		.label_b = "B",
+		.events_compared =
+			calloc(event_count, sizeof(sk_event_comparison)),
+	};
+
+	double *samples_a = calloc(runs, sizeof(double));
+	double *samples_b = calloc(runs, sizeof(double));
+	for (usize j = 0; j < event_count; j++) {
+		for (usize i = 0; i < runs; i++) {
+			samples_a[i] = (double)results_a[i].counts[j];
+			samples_b[i] = (double)results_b[i].counts[j];
+		}
+
+		sk_event_comparison *ec = &c->events_compared[j];
+		ec->p_value = mann_whitney_p(samples_a, samples_b, runs);
+		bootstrap_change(samples_a, samples_b, runs, rng,
+				 &ec->change_low, &ec->change_high);
+		ec->median_a = median(samples_a, runs);
+		ec->median_b = median(samples_b, runs);
+		ec->change = relative_change(ec->median_a, ec->median_b);
+
+		ec->verdict = SK_NO_DIFFERENCE;
+		if (ec->p_value < 0.05 && ec->change_low > 0)
+			ec->verdict = SK_B_MORE;
+		if (ec->p_value < 0.05 && ec->change_high < 0)
+			ec->verdict = SK_B_FEWER;
+	}
+
+	free(samples_a);
+	free(samples_b);
+	free(results_a);
+	free(results_b);
+	return c;
+}
+
+sk_comparison *sk_compare(sk_events *e, size_t runs, sk_callback a,
+			  void *a_context, sk_callback b, void *b_context)
+{
+	assert(runs >= 2);
+
+	sk_result *results_a = calloc(runs, sizeof(sk_result));
+	sk_result *results_b = calloc(runs, sizeof(sk_result));
+	u64 rng = harness_seed();
+
+	// One untimed call each, so neither side pays for cold code or
+	// first-touch page faults.
+	a(a_context);
+	b(b_context);
+
+	// Pairing runs and flipping a coin for which goes first spreads drift
+	// (thermal, frequency, other processes) evenly over both sides.
+	noise_filter nf = noise_filter_create(e);
+	sk_events_arm(e);
+	for (usize i = 0; i < runs; i++) {
+		if (next_random(&rng) & 1) {
+			measure_clean_call(&nf, e, a, a_context, &results_a[i]);
+			measure_clean_call(&nf, e, b, b_context, &results_b[i]);
+		} else {
+			measure_clean_call(&nf, e, b, b_context, &results_b[i]);
+			measure_clean_call(&nf, e, a, a_context, &results_a[i]);
+		}
+	}
+	sk_events_disarm(e);
+
+	sk_comparison *c =
+		summarize_comparison(e, runs, results_a, results_b, &rng);
+	c->discarded = nf.discarded;
+	return c;
+}
+
+const sk_event_comparison *sk_comparison_get(const sk_comparison *c, size_t i)
+{
+	assert(i < c->events->count);
+	return &c->events_compared[c->events->event_indices[i]];
+}
+
+size_t sk_comparison_discarded(const sk_comparison *c)
+{
+	return c->discarded;
+}
+
+void sk_comparison_print(const sk_comparison *c)
+{
+	const sk_events *e = c->events;
+
+	printf("\033[1m=== simple-kpc comparison of %s → %s (%zu runs each) "
+	       "===\033[m\n\n",
+	       c->label_a, c->label_b, c->runs);
+	if (c->discarded)
+		printf("%zu disturbed run(s) discarded and rerun\n\n",
+		       c->discarded);
+	setlocale(LC_NUMERIC, "");
+	for (usize i = 0; i < e->count; i++) {
+		const char *name = event_name(e, e->human_readable_names[i]);
+		const sk_event_comparison *ec = sk_comparison_get(c, i);
+
+		char verdict[64] = "no difference";
+		const char *color = "";
+		if (ec->verdict == SK_B_FEWER) {
+			snprintf(verdict, sizeof(verdict), "%s fewer",
+				 c->label_b);
+			color = "\033[32m";
+		} else if (ec->verdict == SK_B_MORE) {
+			snprintf(verdict, sizeof(verdict), "%s more",
+				 c->label_b);
+			color = "\033[31m";
+		}
+
+		printf("\033[32m%'16.0f → %'16.0f \033[95m%s\033[m\n", ec->median_a,
+		       ec->median_b, name);
+		printf("%18s%s%+.2f%% [%+.2f%%, %+.2f%%], p = %.4f: %s\033[m\n",
+		       "", color, 100 * ec->change, 100 * ec->change_low,
+		       100 * ec->change_high, ec->p_value, verdict);
+	}
+}
+
+void sk_comparison_destroy(sk_comparison *c)
+{
+	free(c->events_compared);
+	free(c);
+}
+
+// Cache flushing. Registered buffers are evicted line by line, which is exact
+// and cheap; without any, a buffer twice the size of the last-level cache is
+// swept instead, since replacement isn’t strictly LRU. Evicting lines from
+// user space needs clflush on x86 and dc civac on Arm (which Linux allows
+// from EL0); macOS wraps the latter as sys_dcache_flush.
+
+#define FLUSH_LINE 64
+#define DEFAULT_LLC_BYTES (32 * 1024 * 1024)
+
+typedef struct {
+	const u8 *start;
+	usize size;
+} flush_buffer;
+
+struct sk_cache_flusher {
+	flush_buffer *buffers;
+	usize buffer_count;
+	usize buffer_capacity;
+
+	usize llc_bytes;
+	u8 *thrash;
+};
+
+// Parses sysfs cache sizes such as “32768K”.
+static usize parse_cache_size(const char *text)
+{
+	char *end;
+	usize size = strtoull(text, &end, 10);
+	if (*end == 'K')
+		size *= 1024;
+	else if (*end == 'M')
+		size *= 1024 * 1024;
+	return size;
+}
+
+static usize detect_llc_bytes(void)
+{
+#ifdef __APPLE__
+	usize size = sysctl_usize("hw.l3cachesize");
+	if (!size)
+		size = sysctl_usize("hw.perflevel0.l2cachesize");
+	if (!size)
+		size = sysctl_usize("hw.l2cachesize");
+	return size;
+#else
+	usize best_level = 0;
+	usize size = 0;
+	for (usize index = 0;; index++) {
+		char path[96];
+		char text[32];
+		snprintf(path, sizeof(path),
+			 "/sys/devices/system/cpu/cpu0/cache/index%zu/level",
+			 index);
+		FILE *f = fopen(path, "r");
+		if (!f)
+			break;
+		usize level = 0;
+		if (fscanf(f, "%zu", &level) != 1)
+			level = 0;
+		fclose(f);
+
+		snprintf(path, sizeof(path),
+			 "/sys/devices/system/cpu/cpu0/cache/index%zu/size",
+			 index);
+		f = fopen(path, "r");
+		if (!f)
+			continue;
+		if (fgets(text, sizeof(text), f) && level >= best_level) {
+			best_level = level;
+			size = parse_cache_size(text);
+		}
+		fclose(f);
+	}
+	return size;
+#endif
+}
+
+sk_cache_flusher *sk_cache_flusher_create(void)
+{
+	sk_cache_flusher *fl = calloc(1, sizeof(sk_cache_flusher));
+	fl->llc_bytes = detect_llc_bytes();
+	if (!fl->llc_bytes)
+		fl->llc_bytes = DEFAULT_LLC_BYTES;
+	return fl;
+}
+
+void sk_cache_flusher_add_buffer(sk_cache_flusher *fl, const void *start,
+				 size_t size)
+{
+	if (fl->buffer_count == fl->buffer_capacity) {
+		fl->buffer_capacity =
+			grown_capacity(fl->buffer_capacity, fl->buffer_count + 1);
+		fl->buffers = xrealloc(fl->buffers, fl->buffer_capacity *
+							    sizeof(flush_buffer));
+	}
+	fl->buffers[fl->buffer_count++] = (flush_buffer){ start, size };
+}
+
+size_t sk_cache_flusher_llc_bytes(const sk_cache_flusher *fl)
+{
+	return fl->llc_bytes;
+}
+
+static bool flush_lines(const u8 *start, usize size)
+{
+#if defined(__APPLE__)
+	sys_dcache_flush((void *)start, size);
+	return true;
+#elif defined(__x86_64__) || defined(__i386__)
+	for (usize i = 0; i < size; i += FLUSH_LINE)
+		__builtin_ia32_clflush(start + i);
+	__builtin_ia32_clflush(start + size - 1);
+	__builtin_ia32_mfence();
+	return true;
+#elif defined(__aarch64__)
+	for (usize i = 0; i < size; i += FLUSH_LINE)
+		__asm__ volatile("dc civac, %0" : : "r"(start + i) : "memory");
+	__asm__ volatile("dc civac, %0" : : "r"(start + size - 1) : "memory");
+	__asm__ volatile("dsb ish" : : : "memory");
+	return true;
+#else
+	(void)start;
+	(void)size;
+	return false;
+#endif
+}
+
+static void thrash(sk_cache_flusher *fl)
+{
+	usize size = 2 * fl->llc_bytes;
+	if (!fl->thrash)
+		fl->thrash = calloc(size, 1);
+	// Writing as well as reading evicts dirty lines too.
+	for (usize i = 0; i < size; i += FLUSH_LINE)
+		fl->thrash[i]++;
+	__asm__ volatile("" : : "r"(fl->thrash) : "memory");
+}
+
+void sk_cache_flush(sk_cache_flusher *fl)
+{
+	bool flushed = fl->buffer_count > 0;
+	for (usize i = 0; flushed && i < fl->buffer_count; i++) {
+		if (fl->buffers[i].size)
+			flushed = flush_lines(fl->buffers[i].start,
+					      fl->buffers[i].size);
+	}
+	if (!flushed)
+		thrash(fl);
+}
+
+void sk_cache_flusher_destroy(sk_cache_flusher *fl)
+{
+	free(fl->buffers);
+	free(fl->thrash);
+	free(fl);
+}
+
+static void flush_callback(void *context)
+{
+	sk_cache_flush(context);
+}
+
+sk_comparison *sk_compare_cache_states(sk_events *e, size_t runs,
+				       sk_callback f, void *context,
+				       sk_cache_flusher *fl)
+{
+	assert(runs >= 2);
+
+	sk_result *warm = calloc(runs, sizeof(sk_result));
+	sk_result *cold = calloc(runs, sizeof(sk_result));
+	u64 rng = harness_seed();
+
+	// Each warm run follows an untimed call and each cold run a flush
+	// (before every attempt, should one be disturbed), so the order of a
+	// pair doesn’t change either’s cache state.
+	noise_filter nf = noise_filter_create(e);
+	sk_events_arm(e);
+	for (usize i = 0; i < runs; i++) {
+		if (next_random(&rng) & 1) {
+			f(context);
+			measure_clean_call(&nf, e, f, context, &warm[i]);
+			measure_prepared_call(&nf, e, flush_callback, fl, f,
+					      context, &cold[i]);
+		} else {
+			measure_prepared_call(&nf, e, flush_callback, fl, f,
+					      context, &cold[i]);
+			f(context);
+			measure_clean_call(&nf, e, f, context, &warm[i]);
+		}
+	}
+	sk_events_disarm(e);
+
+	sk_comparison *c = summarize_comparison(e, runs, warm, cold, &rng);
+	c->discarded = nf.discarded;
+	c->label_a = "warm";
+	c->label_b = "cold";
+	return c;
+}
+
+typedef struct {
+	char *name;
+	sk_callback f;
+	void *context;
+} gate_benchmark;
+
+typedef struct {
+	char *benchmark;
+	char *event;
+	u64 value;
+} baseline_entry;
+
+struct sk_gate {
+	sk_events *events;
+	char *baseline_path;
+	double tolerances[KPC_MAX_COUNTERS]; // per distinct event
+
+	gate_benchmark *benchmarks;
+	usize benchmark_count;
+	usize benchmark_capacity;
+};
+
+#define DEFAULT_TOLERANCE 0.05
+
+sk_gate *sk_gate_create(sk_events *e, const char *baseline_path)
+{
+	sk_gate *g = calloc(1, sizeof(sk_gate));
+	*g = (sk_gate){
+		.events = e,
+		.baseline_path = strdup(baseline_path),
+	};
+	for (usize i = 0; i < KPC_MAX_COUNTERS; i++)
+		g->tolerances[i] = DEFAULT_TOLERANCE;
+	return g;
+}
+
+void sk_gate_set_tolerance(sk_gate *g, size_t i, double tolerance)
+{
+	assert(i < g->events->count);
+	g->tolerances[g->events->event_indices[i]] = tolerance;
+}
+
+void sk_gate_add(sk_gate *g, const char *name, sk_callback f, void *context)
+{
+	if (g->benchmark_count == g->benchmark_capacity) {
+		g->benchmark_capacity = grown_capacity(g->benchmark_capacity,
+						       g->benchmark_count + 1);
+		g->benchmarks = xrealloc(g->benchmarks,
+					 g->benchmark_capacity *
+						 sizeof(gate_benchmark));
+	}
+
+	g->benchmarks[g->benchmark_count++] = (gate_benchmark){
+		.name = strdup(name),
+		.f = f,
+		.context = context,
+	};
+}
+
+void sk_gate_destroy(sk_gate *g)
+{
+	for (usize i = 0; i < g->benchmark_count; i++)
+		free(g->benchmarks[i].name);
+	free(g->benchmarks);
+	free(g->baseline_path);
+	free(g);
+}
+
+// The baseline is plain text, one “benchmark<TAB>event<TAB>count” line per
+// measured value, keyed by internal event name so renaming an event for
+// display doesn’t orphan it. Lines starting with “#” describe the host it was
+// recorded on and are skipped. Returns the number of entries read, or zero if
+// there is no baseline yet.
+static usize read_baseline(const char *path, baseline_entry **entries_out)
+{
+	*entries_out = NULL;
+	FILE *f = fopen(path, "r");
+	if (!f)
+		return 0;
+
+	baseline_entry *entries = NULL;
+	usize count = 0;
+	usize capacity = 0;
+	char line[1024];
+	while (fgets(line, sizeof(line), f)) {
+		if (line[0] == '#')
+			continue;
+		char *benchmark = strtok(line, "\t");
+		char *event = strtok(NULL, "\t");
+		char *value = strtok(NULL, "\t\n");
+		if (!benchmark || !event || !value)
+			continue;
+
+		if (count == capacity) {
+			capacity = grown_capacity(capacity, count + 1);
+			entries = xrealloc(entries,
+					   capacity * sizeof(baseline_entry));
+		}
+		entries[count++] = (baseline_entry){
+			.benchmark = strdup(benchmark),
+			.event = strdup(event),
+			.value = strtoull(value, NULL, 10),
+		};
+	}
+
+	fclose(f);
+	*entries_out = entries;
+	return count;
+}
+
+static void free_baseline(baseline_entry *entries, usize count)
+{
+	for (usize i = 0; i < count; i++) {
+		free(entries[i].benchmark);
+		free(entries[i].event);
+	}
+	free(entries);
+}
+
+static const baseline_entry *find_baseline(const baseline_entry *entries,
+					   usize count, const char *benchmark,
+					   const char *event)
+{
+	for (usize i = 0; i < count; i++) {
+		if (strcmp(entries[i].benchmark, benchmark) == 0 &&
+		    strcmp(entries[i].event, event) == 0)
+			return &entries[i];
+	}
+	return NULL;
+}
+
+static void write_baseline(const sk_gate *g, const u64 *medians)
+{
+	const sk_events *e = g->events;
+
+	FILE *f = fopen(g->baseline_path, "w");
+	if (!f) {
+		fprintf(stderr, "simple_kpc: failed to write baseline %s\n",
+			g->baseline_path);
+		exit(1);
+	}
+
+	write_host(f, "# ", &host);
+	for (usize b = 0; b < g->benchmark_count; b++) {
+		for (usize j = 0; j < e->unique_count; j++) {
+			fprintf(f, "%s\t%s\t%llu\n", g->benchmarks[b].name,
+				event_name(e, e->unique_events[j]),
+				(unsigned long long)
+					medians[b * e->unique_count + j]);
+		}
+	}
+
+	fclose(f);
+}
+
+int sk_gate_run(sk_gate *g, size_t runs)
+{
+	assert(runs >= 1);
+
+	sk_events *e = g->events;
+	usize event_count = e->unique_count;
+
+	// Instruction counts barely move between runs, but everything else
+	// does; the median of a handful of runs shrugs off the odd outlier.
+	u64 *medians = calloc(g->benchmark_count * event_count, sizeof(u64));
+	sk_result *results = calloc(runs, sizeof(sk_result));
+	double *samples = calloc(runs, sizeof(double));
+	usize discarded = 0;
+
+	for (usize b = 0; b < g->benchmark_count; b++) {
+		gate_benchmark *benchmark = &g->benchmarks[b];
+
+		benchmark->f(benchmark->context);
+		noise_filter nf = noise_filter_create(e);
+		sk_events_arm(e);
+		for (usize r = 0; r < runs; r++)
+			measure_clean_call(&nf, e, benchmark->f,
+					   benchmark->context, &results[r]);
+		sk_events_disarm(e);
+		discarded += nf.discarded;
+
+		for (usize j = 0; j < event_count; j++) {
+			for (usize r = 0; r < runs; r++)
+				samples[r] = (double)results[r].counts[j];
+			medians[b * event_count + j] =
+				(u64)median(samples, runs);
+		}
+	}
+	free(results);
+	free(samples);
+
+	const char *update = getenv("SK_UPDATE_BASELINE");
+	baseline_entry *entries = NULL;
+	usize entry_count = read_baseline(g->baseline_path, &entries);
+	if (entry_count == 0 || (update && *update && *update != '0')) {
+		write_baseline(g, medians);
+		printf("simple_kpc: wrote baseline %s\n", g->baseline_path);
+		free(medians);
+		free_baseline(entries, entry_count);
+		return 0;
+	}
+
+	printf("\033[1m=== simple-kpc regression gate ===\033[m\n\n");
+	setlocale(LC_NUMERIC, "");
+	if (discarded)
+		printf("%zu disturbed run(s) discarded and rerun\n\n",
+		       discarded);
+	usize regressions = 0;
+	for (usize b = 0; b < g->benchmark_count; b++) {
+		const char *name = g->benchmarks[b].name;
+		printf("\033[1m%s\033[m\n", name);
+
+		for (usize j = 0; j < event_count; j++) {
+			const char *event = event_name(e, e->unique_events[j]);
+			const char *label = unique_event_name(e, j);
+			u64 current = medians[b * event_count + j];
+			const baseline_entry *baseline = find_baseline(
+				entries, entry_count, name, event);
+			if (!baseline) {
+				printf("\033[32m%'16llu \033[95m%s\033[m: no "
+				       "baseline\n",
+				       (unsigned long long)current, label);
+				continue;
+			}
+
+			double change = relative_change((double)baseline->value,
+							(double)current);
+			const char *status = "\033[32mok";
+			if (change > g->tolerances[j]) {
+				status = "\033[31mREGRESSION";
+				regressions++;
+			} else if (change < -g->tolerances[j]) {
+				status = "\033[32mimproved, update baseline";
+			}
+
+			printf("\033[32m%'16llu → %'16llu \033[95m%s\033[m %+.2f%% "
+			       "(tolerance %.2f%%): %s\033[m\n",
+			       (unsigned long long)baseline->value,
+			       (unsigned long long)current, label, 100 * change,
+			       100 * g->tolerances[j], status);
+		}
+	}
+
+	free_baseline(entries, entry_count);
+	free(medians);
+
+	if (regressions) {
+		printf("\n%zu regression(s)\n", regressions);
+		return 1;
+	}
+	return 0;
+}
+
+// Single-stepping. The child stops itself three times: before an empty call,
+// before f, and after f. Each stretch between stops is counted one step at a
+// time, and the empty call’s count (the cost of the call and of raise itself)
+// is subtracted from f’s. Both calls load their function and argument from
+// volatile locals, so the empty one can’t be inlined away and they cost the
+// same. Signals the
+// child receives along the way are passed on, unless they are fatal: then f
+// crashed, and stepping on would rerun the faulting instruction forever.
+
+#ifdef __APPLE__
+#define TRACE_ME() ptrace(PT_TRACE_ME, 0, NULL, 0)
+#define SINGLE_STEP(pid, signal) ptrace(PT_STEP, pid, (caddr_t)1, signal)
+#else
+#define TRACE_ME() ptrace(PTRACE_TRACEME, 0, NULL, NULL)
+#define SINGLE_STEP(pid, signal)                                               \
+	ptrace(PTRACE_SINGLESTEP, pid, NULL, (void *)(intptr_t)(signal))
+#endif
+
+static bool is_fatal_signal(int signal)
+{
+	switch (signal) {
+	case SIGSEGV:
+	case SIGBUS:
+	case SIGILL:
+	case SIGFPE:
+	case SIGABRT:
+		return true;
+	default:
+		return false;
+	}
+}
+
+static void empty_callback(void *context)
+{
+	(void)context;
+}
+
+// Marks a stretch boundary; noinline so both stretches pay the same for it.
+__attribute__((noinline)) static void stop_self(void)
+{
+	raise(SIGSTOP);
+}
+
+int sk_count_instructions(sk_callback f, void *context, uint64_t *out)
+{
+	fflush(NULL);
+	pid_t pid = fork();
+	if (pid < 0)
+		return -1;
+
+	if (pid == 0) {
+		if (TRACE_ME() != 0)
+			_exit(1);
+		sk_callback volatile calibration = empty_callback;
+		sk_callback volatile measured = f;
+		void *volatile calibration_context = NULL;
+		void *volatile measured_context = context;
+		stop_self();
+		calibration(calibration_context);
+		stop_self();
+		measured(measured_context);
+		stop_self();
+		_exit(0);
+	}
+
+	// stretches[0] is the empty call, stretches[1] is f.
+	u64 stretches[2] = { 0 };
+	int stops = 0;
+	int status = 0;
+	while (waitpid(pid, &status, 0) == pid && WIFSTOPPED(status)) {
+		int signal = WSTOPSIG(status);
+		int forwarded = 0;
+		if (signal == SIGSTOP)
+			stops++;
+		else if (signal == SIGTRAP && stops >= 1 && stops <= 2)
+			stretches[stops - 1]++;
+		else if (is_fatal_signal(signal))
+			break;
+		else if (signal != SIGTRAP)
+			forwarded = signal;
+
+		if (stops == 3)
+			break;
+		if (SINGLE_STEP(pid, forwarded) != 0)
+			break;
+	}
+
+	kill(pid, SIGKILL);
+	waitpid(pid, NULL, 0);
+	if (stops != 3)
+		return -1;
+
+	*out = stretches[1] > stretches[0] ? stretches[1] - stretches[0] : 0;
+	return 0;
+}
+
+// Isolation. Every setting is tried independently and its errno kept, so a
+// process without privileges still gets whatever it is allowed, and restoring
+// undoes only what was applied. Affinity on macOS is the Mach affinity tag,
+// which is a hint at best and unsupported on Apple Silicon, where it fails.
+
+#define DEFAULT_PREFAULT_STACK (256 * 1024)
+#define PREFAULT_PAGE 4096
+
+struct sk_isolation {
+	sk_isolate_config config;
+	unsigned applied;
+	unsigned failed;
+	int errors[SK_ISOLATE_SETTINGS];
+	pthread_t thread;
+
+#ifdef __linux__
+	cpu_set_t previous_affinity;
+#endif
+	int previous_policy;
+	struct sched_param previous_param;
+
+	void *arena;
+};
+
+static unsigned setting_index(unsigned setting)
+{
+	return (unsigned)__builtin_ctz(setting);
+}
+
+static void note_setting(sk_isolation *iso, unsigned setting, int error)
+{
+	if (error) {
+		iso->failed |= setting;
+		iso->errors[setting_index(setting)] = error;
+	} else {
+		iso->applied |= setting;
+	}
+}
+
+static int pin_thread(sk_isolation *iso)
+{
+#ifdef __linux__
+	pthread_getaffinity_np(iso->thread, sizeof(cpu_set_t),
+			       &iso->previous_affinity);
+	cpu_set_t set;
+	CPU_ZERO(&set);
+	CPU_SET(iso->config.cpu, &set);
+	return pthread_setaffinity_np(iso->thread, sizeof(cpu_set_t), &set);
+#elif defined(__APPLE__)
+	// Tag zero means “no affinity”, so CPU n gets tag n + 1.
+	thread_affinity_policy_data_t policy = { iso->config.cpu + 1 };
+	kern_return_t result = thread_policy_set(
+		pthread_mach_thread_np(iso->thread), THREAD_AFFINITY_POLICY,
+		(thread_policy_t)&policy, THREAD_AFFINITY_POLICY_COUNT);
+	return result == KERN_SUCCESS ? 0 : ENOTSUP;
+#else
+	return ENOTSUP;
+#endif
+}
+
+static void unpin_thread(sk_isolation *iso)
+{
+#ifdef __linux__
+	pthread_setaffinity_np(iso->thread, sizeof(cpu_set_t),
+			       &iso->previous_affinity);
+#elif defined(__APPLE__)
+	thread_affinity_policy_data_t policy = { THREAD_AFFINITY_TAG_NULL };
+	thread_policy_set(pthread_mach_thread_np(iso->thread),
+			  THREAD_AFFINITY_POLICY, (thread_policy_t)&policy,
+			  THREAD_AFFINITY_POLICY_COUNT);
+#endif
+}
+
+static int make_realtime(sk_isolation *iso)
+{
+	pthread_getschedparam(iso->thread, &iso->previous_policy,
+			      &iso->previous_param);
+	struct sched_param param = {
+		.sched_priority = sched_get_priority_max(SCHED_FIFO),
+	};
+	return pthread_setschedparam(iso->thread, SCHED_FIFO, &param);
+}
+
+// Touches every page of a stack frame of the given size, so the first calls
+// made under isolation don’t take page faults growing the stack. noinline
+// keeps the frame from merging into the caller’s.
+__attribute__((noinline)) static void prefault_stack(usize bytes)
+{
+	u8 frame[bytes];
+	for (usize i = 0; i < bytes; i += PREFAULT_PAGE)
+		frame[i] = 0;
+	frame[bytes - 1] = 0;
+	__asm__ volatile("" : : "r"(frame) : "memory");
+}
+
+static int prefault_arena(sk_isolation *iso)
+{
+	usize bytes = iso->config.arena_bytes;
+	iso->arena = malloc(bytes);
+	if (!iso->arena)
+		return ENOMEM;
+	memset(iso->arena, 0, bytes);
+	return 0;
+}
+
+sk_isolation *sk_isolate(const sk_isolate_config *config)
+{
+	sk_isolation *iso = calloc(1, sizeof(sk_isolation));
+	iso->config = *config;
+	iso->thread = pthread_self();
+	if (iso->config.stack_bytes == 0)
+		iso->config.stack_bytes = DEFAULT_PREFAULT_STACK;
+
+	if (config->cpu >= 0)
+		note_setting(iso, SK_ISOLATE_AFFINITY, pin_thread(iso));
+	if (config->realtime)
+		note_setting(iso, SK_ISOLATE_REALTIME, make_realtime(iso));
+	if (config->arena_bytes)
+		note_setting(iso, SK_ISOLATE_ARENA, prefault_arena(iso));
+
+	// Lock after faulting the arena in, so it’s resident and stays so; the
+	// stack is touched after locking since MCL_FUTURE covers its growth.
+	if (config->lock_memory)
+		note_setting(iso, SK_ISOLATE_MEMORY_LOCK,
+			     mlockall(MCL_CURRENT | MCL_FUTURE) ? errno : 0);
+	prefault_stack(iso->config.stack_bytes);
+	return iso;
+}
+
+unsigned sk_isolation_failures(const sk_isolation *iso)
+{
+	return iso->failed;
+}
+
+void *sk_isolation_arena(const sk_isolation *iso, size_t *size)
+{
+	if (size)
+		*size = iso->arena ? iso->config.arena_bytes : 0;
+	return iso->arena;
+}
+
+void sk_isolation_print(const sk_isolation *iso)
+{
+	static const char *const settings[SK_ISOLATE_SETTINGS] = {
+		"pin to CPU",
+		"run as SCHED_FIFO",
+		"lock memory",
+		"prefault heap arena",
+	};
+
+	for (unsigned i = 0; i < SK_ISOLATE_SETTINGS; i++) {
+		unsigned setting = 1u << i;
+		if (iso->applied & setting)
+			fprintf(stderr, "simple_kpc: isolate: %s: ok\n",
+				settings[i]);
+		else if (iso->failed & setting)
+			fprintf(stderr, "simple_kpc: isolate: %s: %s\n",
+				settings[i], strerror(iso->errors[i]));
+	}
+}
+
+// Must be called from the thread that called sk_isolate.
+void sk_restore(sk_isolation *iso)
+{
+	assert(pthread_equal(iso->thread, pthread_self()));
+	if (iso->applied & SK_ISOLATE_MEMORY_LOCK)
+		munlockall();
+	if (iso->applied & SK_ISOLATE_REALTIME)
+		pthread_setschedparam(iso->thread, iso->previous_policy,
+				      &iso->previous_param);
+	if (iso->applied & SK_ISOLATE_AFFINITY)
+		unpin_thread(iso);
+	free(iso->arena);
+	free(iso);
+}
+
+// The sampler. kpc only lets a thread read its own counters, so at every tick
+// the sampler thread signals each watched thread, whose handler copies its
+// counters into a preallocated slot and bumps a sequence number. The sampler
+// waits for every slot to catch up, sums them, and writes one record into the
+// ring. Nothing is allocated between start and stop.
+//
+// The sequence number works as a seqlock: odd while a handler is writing. A
+// handler can land after the sampler has stopped waiting for it, so the
+// sampler copies each slot out and keeps the copy only if the sequence was
+// even and unchanged around it, and new since the last one. Only one sampler
+// runs at a time, since all of them share the signal handler.
+
+typedef struct {
+	u64 counters[KPC_MAX_COUNTERS];
+	u64 read_ns;
+	u64 cpu_ns;
+	int cpu;
+} slot_reading;
+
+typedef struct {
+	pthread_t thread;
+	slot_reading live;    // written by the handler
+	slot_reading reading; // the last consistent copy of live
+	u64 read_sequence;    // live’s sequence when reading was copied
+	u64 baseline[KPC_MAX_COUNTERS];
+	u64 previous[KPC_MAX_COUNTERS]; // at the last sample
+	u64 baseline_cpu_ns;
+	_Atomic u64 sequence;
+} sampler_slot;
+
+struct sk_sampler {
+	sk_events *events;
+	sk_sampler_config config;
+
+	sampler_slot slots[SK_SAMPLER_MAX_THREADS];
+	usize slot_count;
+
+	sk_sample *ring;
+	usize head;
+	usize total;
+
+	pthread_t thread;
+	_Atomic bool running;
+	u64 start_ns;
+	struct sigaction previous_action;
+
+	// Each interval’s counts, summed by the core type the thread was on
+	// when the interval ended.
+	u64 core_type_counts[SK_MAX_CORE_TYPES][KPC_MAX_COUNTERS];
+};
+
+static _Atomic(sk_sampler *) active_sampler = NULL;
+
+static void sampler_signal_handler(int signal)
+{
+	(void)signal;
+	sk_sampler *s = atomic_load(&active_sampler);
+	if (!s)
+		return;
+
+	sampler_slot *slot = NULL;
+	pthread_t self = pthread_self();
+	for (usize i = 0; i < s->slot_count && !slot; i++)
+		if (pthread_equal(s->slots[i].thread, self))
+			slot = &s->slots[i];
+	if (!slot)
+		return;
+
+	int saved_errno = errno;
+	atomic_fetch_add_explicit(&slot->sequence, 1, memory_order_relaxed);
+	atomic_thread_fence(memory_order_release);
+	kpc_get_thread_counters(0, KPC_MAX_COUNTERS, slot->live.counters);
+	slot->live.read_ns = monotonic_ns();
+	slot->live.cpu_ns = thread_cpu_ns();
+	slot->live.cpu = current_cpu();
+	atomic_fetch_add_explicit(&slot->sequence, 1, memory_order_release);
+	errno = saved_errno;
+}
+
+static bool copy_reading(sampler_slot *slot)
+{
+	u64 before = atomic_load_explicit(&slot->sequence, memory_order_acquire);
+	if (before % 2 || before == slot->read_sequence)
+		return false;
+	slot_reading copy = slot->live;
+	atomic_thread_fence(memory_order_acquire);
+	if (atomic_load_explicit(&slot->sequence, memory_order_relaxed) !=
+	    before)
+		return false;
+	slot->reading = copy;
+	slot->read_sequence = before;
+	return true;
+}
+
+static void sleep_until(u64 deadline_ns)
+{
+	u64 now = monotonic_ns();
+	if (now >= deadline_ns)
+		return;
+
+	u64 remaining = deadline_ns - now;
+	struct timespec ts = {
+		.tv_sec = (time_t)(remaining / 1000000000),
+		.tv_nsec = (long)(remaining % 1000000000),
+	};
+	while (nanosleep(&ts, &ts) != 0 && errno == EINTR) {
+	}
+}
+
+// Signals every slot and waits up to one interval for them to answer. A
+// thread that doesn’t answer in time keeps its previous values. Signals can
+// take a scheduler tick to land on a busy thread, so each handler timestamps
+// its own read, and the sample is stamped with the mean of the new ones.
+static u64 poll_slots(sk_sampler *s)
+{
+	u64 targets[SK_SAMPLER_MAX_THREADS];
+	for (usize i = 0; i < s->slot_count; i++) {
+		sampler_slot *slot = &s->slots[i];
+		// A handler already running ends on the next even number,
+		// and the one for this signal two after that.
+		u64 sequence = atomic_load_explicit(&slot->sequence,
+						    memory_order_relaxed);
+		targets[i] = sequence + (sequence % 2 ? 3 : 2);
+		if (pthread_kill(slot->thread, s->config.signal) != 0)
+			targets[i] = 0;
+	}
+
+	u64 deadline = monotonic_ns() + s->config.interval_ns;
+	for (usize i = 0; i < s->slot_count; i++) {
+		while (atomic_load_explicit(&s->slots[i].sequence,
+					    memory_order_acquire) < targets[i] &&
+		       monotonic_ns() < deadline)
+			sched_yield();
+	}
+
+	u64 sum = 0;
+	usize answered = 0;
+	for (usize i = 0; i < s->slot_count; i++) {
+		if (copy_reading(&s->slots[i])) {
+			sum += s->slots[i].reading.read_ns;
+			answered++;
+		}
+	}
+	return answered ? sum / answered : monotonic_ns();
+}
+
+static void take_sample(sk_sampler *s, u64 time_ns)
+{
+	sk_events *e = s->events;
+	sk_sample *sample = &s->ring[s->head];
+	sample->time_ns = time_ns - s->start_ns;
+	sample->counts = (sk_result){ .events = e, .host = &host };
+	sample->counts.scheduling.wall_ns = sample->time_ns;
+	sample->counts.elapsed_ns = sample->time_ns;
+
+	for (usize i = 0; i < s->slot_count; i++) {
+		sampler_slot *slot = &s->slots[i];
+		const slot_reading *reading = &slot->reading;
+		int type = core_type_of(reading->cpu);
+		sample->counts.scheduling.cpu_ns +=
+			reading->cpu_ns - slot->baseline_cpu_ns;
+		for (usize j = 0; j < e->unique_count; j++) {
+			usize idx = e->counter_map[j];
+			sample->counts.counts[j] +=
+				reading->counters[idx] - slot->baseline[idx];
+			if (type >= 0)
+				s->core_type_counts[type][j] +=
+					reading->counters[idx] -
+					slot->previous[idx];
+		}
+		memcpy(slot->previous, reading->counters,
+		       sizeof(slot->previous));
+	}
+
+	s->head = (s->head + 1) % s->config.capacity;
+	s->total++;
+}
+
+static void *sampler_main(void *context)
+{
+	sk_sampler *s = context;
+	u64 next = s->start_ns;
+	while (atomic_load(&s->running)) {
+		next += s->config.interval_ns;
+		sleep_until(next);
+		take_sample(s, poll_slots(s));
+	}
+	return NULL;
+}
+
+sk_sampler *sk_sampler_create(sk_events *e, const sk_sampler_config *config)
+{
+	sk_sampler *s = calloc(1, sizeof(sk_sampler));
+	s->events = e;
+	s->config = (sk_sampler_config){
+		.interval_ns = 10000000,
+		.capacity = 4096,
+		.signal = SIGPROF,
+	};
+	if (config && config->interval_ns)
+		s->config.interval_ns = config->interval_ns;
+	if (config && config->capacity)
+		s->config.capacity = config->capacity;
+	if (config && config->signal)
+		s->config.signal = config->signal;
+
+	s->ring = calloc(s->config.capacity, sizeof(sk_sample));
+	return s;
+}
+
+void sk_sampler_add_thread(sk_sampler *s)
+{
+	assert(!atomic_load(&s->running));
+	if (s->slot_count == SK_SAMPLER_MAX_THREADS) {
+		fprintf(stderr, "simple_kpc: sampler can watch at most %d "
+				"threads\n",
+			SK_SAMPLER_MAX_THREADS);
+		exit(1);
+	}
+
+	sampler_slot *slot = &s->slots[s->slot_count++];
+	slot->thread = pthread_self();
+}
+
+void sk_sampler_start(sk_sampler *s)
+{
+	sk_events *e = s->events;
+	if (s->slot_count == 0)
+		sk_sampler_add_thread(s);
+	stop_recording("samplers read counters from signal handlers");
+
+	sk_sampler *expected = NULL;
+	bool claimed =
+		atomic_compare_exchange_strong(&active_sampler, &expected, s);
+	assert(claimed && "only one sampler can run at a time");
+	(void)claimed;
+
+	struct sigaction action = { .sa_handler = sampler_signal_handler };
+	sigemptyset(&action.sa_mask);
+	action.sa_flags = SA_RESTART;
+	sigaction(s->config.signal, &action, &s->previous_action);
+
+	sk_events_arm(e);
+	s->head = 0;
+	s->total = 0;
+	atomic_store(&s->running, true);
+
+	// The first poll only sets each thread’s baseline.
+	s->start_ns = poll_slots(s);
+	for (usize i = 0; i < s->slot_count; i++) {
+		sampler_slot *slot = &s->slots[i];
+		memcpy(slot->baseline, slot->reading.counters,
+		       sizeof(slot->baseline));
+		memcpy(slot->previous, slot->reading.counters,
+		       sizeof(slot->previous));
+		slot->baseline_cpu_ns = slot->reading.cpu_ns;
+	}
+	memset(s->core_type_counts, 0, sizeof(s->core_type_counts));
+
+	pthread_create(&s->thread, NULL, sampler_main, s);
+}
+
+void sk_sampler_stop(sk_sampler *s)
+{
+	atomic_store(&s->running, false);
+	pthread_join(s->thread, NULL);
+	sk_events_disarm(s->events);
+	sigaction(s->config.signal, &s->previous_action, NULL);
+	atomic_store(&active_sampler, NULL);
+}
+
+size_t sk_sampler_count(const sk_sampler *s)
+{
+	return s->total < s->config.capacity ? s->total : s->config.capacity;
+}
+
+void sk_sampler_core_type_counts(const sk_sampler *s, size_t type,
+				 sk_result *out)
+{
+	assert(type < host.core_type_count);
+	*out = (sk_result){ .events = s->events, .host = &host };
+	memcpy(out->counts, s->core_type_counts[type], sizeof(out->counts));
+}
+
+const sk_sample *sk_sampler_get(const sk_sampler *s, size_t i)
+{
+	usize count = sk_sampler_count(s);
+	assert(i < count);
+	usize capacity = s->config.capacity;
+	return &s->ring[(s->head + capacity - count + i) % capacity];
+}
+
+int sk_sampler_write_csv(const sk_sampler *s, const char *path)
+{
+	const sk_events *e = s->events;
+	FILE *f = fopen(path, "w");
+	if (!f)
+		return -1;
+
+	usize cycles = 0;
+	usize instructions = 0;
+	bool has_ipc = find_event(e, CYCLES_EVENTS, &cycles) &&
+		       find_event(e, INSTRUCTIONS_EVENTS, &instructions);
+
+	write_host(f, "# ", &host);
+	fprintf(f, "time_s");
+	for (usize i = 0; i < e->count; i++) {
+		const char *name = event_name(e, e->human_readable_names[i]);
+		fprintf(f, ",%s,%s/s", name, name);
+	}
+	bool has_ghz = find_event(e, CYCLES_EVENTS, &cycles) && !degraded;
+	fprintf(f, "%s%s\n", has_ipc ? ",ipc" : "", has_ghz ? ",ghz" : "");
+
+	// Each row covers the interval since the previous sample. Once the ring
+	// has wrapped, the oldest retained sample has no predecessor.
+	usize count = sk_sampler_count(s);
+	sk_sample previous = { .counts = { .events = s->events } };
+	for (usize i = 0; i < count; i++) {
+		const sk_sample *sample = sk_sampler_get(s, i);
+		if (i == 0 && s->total > count) {
+			previous = *sample;
+			continue;
+		}
+
+		sk_result delta;
+		sk_result_diff(&sample->counts, &previous.counts, &delta);
+		double seconds =
+			(double)(sample->time_ns - previous.time_ns) / 1e9;
+
+		fprintf(f, "%.6f", (double)sample->time_ns / 1e9);
+		for (usize k = 0; k < e->count; k++) {
+			u64 value = sk_result_get(&delta, k);
+			fprintf(f, ",%llu,%.0f", (unsigned long long)value,
+				seconds > 0 ? (double)value / seconds : 0);
+		}
+		if (has_ipc) {
+			double c = (double)delta.counts[cycles];
+			fprintf(f, ",%.4f",
+				c > 0 ? (double)delta.counts[instructions] / c
+				      : 0);
+		}
+		if (has_ghz)
+			fprintf(f, ",%.3f", sk_result_frequency(&delta));
+		fprintf(f, "\n");
+		previous = *sample;
+	}
+
+	fclose(f);
+	return 0;
+}
+
+// Intervals where the watched threads barely ran say nothing about the clock.
+#define THROTTLE_MIN_BUSY 0.1
+#define THROTTLE_DEFAULT_THRESHOLD 0.1
+
+// With no nominal frequency to go by, the reference is the 95th percentile of
+// the busy intervals’ frequencies, which is what the machine can sustain.
+static double reference_ghz(const double *ghz, usize count)
+{
+	if (host.nominal_ghz > 0)
+		return host.nominal_ghz;
+
+	double *busy = calloc(count ? count : 1, sizeof(double));
+	usize n = 0;
+	for (usize i = 0; i < count; i++)
+		if (ghz[i] > 0)
+			busy[n++] = ghz[i];
+	double reference = 0;
+	if (n > 0) {
+		qsort(busy, n, sizeof(double), compare_doubles);
+		reference = busy[n * 95 / 100 < n ? n * 95 / 100 : n - 1];
+	}
+	free(busy);
+	return reference;
+}
+
+size_t sk_sampler_throttling(const sk_sampler *s, double threshold,
+			     sk_throttle *out, size_t max)
+{
+	if (threshold <= 0)
+		threshold = THROTTLE_DEFAULT_THRESHOLD;
+
+	usize count = sk_sampler_count(s);
+	if (count < 2)
+		return 0;
+
+	// ghz[i] covers the interval ending at sample i; zero if idle.
+	double *ghz = calloc(count, sizeof(double));
+	for (usize i = 1; i < count; i++) {
+		const sk_sample *a = sk_sampler_get(s, i - 1);
+		const sk_sample *b = sk_sampler_get(s, i);
+		sk_result delta;
+		sk_result_diff(&b->counts, &a->counts, &delta);
+		u64 interval = b->time_ns - a->time_ns;
+		if ((double)delta.scheduling.cpu_ns >=
+		    THROTTLE_MIN_BUSY * (double)interval)
+			ghz[i] = sk_result_frequency(&delta);
+	}
+
+	double limit = (1 - threshold) * reference_ghz(ghz, count);
+	usize written = 0;
+	sk_throttle *current = NULL;
+	usize intervals = 0;
+	for (usize i = 1; i < count; i++) {
+		bool slow = ghz[i] > 0 && ghz[i] < limit;
+		if (!slow) {
+			current = NULL;
+			continue;
+		}
+		if (!current) {
+			if (written == max)
+				break;
+			current = &out[written++];
+			*current = (sk_throttle){
+				.start_ns = sk_sampler_get(s, i - 1)->time_ns,
+				.min_ghz = ghz[i],
+			};
+			intervals = 0;
+		}
+		current->end_ns = sk_sampler_get(s, i)->time_ns;
+		current->min_ghz = fmin(current->min_ghz, ghz[i]);
+		current->mean_ghz =
+			(current->mean_ghz * (double)intervals + ghz[i]) /
+			(double)(intervals + 1);
+		intervals++;
+	}
+
+	free(ghz);
+	return written;
+}
+
+void sk_sampler_destroy(sk_sampler *s)
+{
+	free(s->ring);
+	free(s);
+}
+
+// Phase detection runs a two-sided CUSUM over every metric of each interval:
+// the per-second rate of each distinct event, plus IPC when available. Values
+// are standardized against the running mean and deviation of the current phase,
+// and a phase ends as soon as any metric’s cumulative drift passes the
+// threshold. The deviation is floored at a fraction of the mean, so nearly
+// constant metrics don’t turn every wobble into a new phase.
+
+#define PHASE_RELATIVE_NOISE_FLOOR 0.05
+#define PHASE_MAX_METRICS (KPC_MAX_COUNTERS + 1)
+
+typedef struct {
+	usize count;
+	double mean[PHASE_MAX_METRICS];
+	double m2[PHASE_MAX_METRICS];
+	double high[PHASE_MAX_METRICS];
+	double low[PHASE_MAX_METRICS];
+} phase_detector;
+
+static void phase_detector_reset(phase_detector *d)
+{
+	memset(d, 0, sizeof(*d));
+}
+
+// Feeds one interval’s metrics. Returns true if they start a new phase.
+static bool phase_detector_push(phase_detector *d, const double *metrics,
+				usize metric_count, const sk_phase_config *c)
+{
+	bool changed = false;
+	if (d->count >= c->min_samples) {
+		for (usize i = 0; i < metric_count; i++) {
+			double variance = d->m2[i] / (double)(d->count - 1);
+			double floor = PHASE_RELATIVE_NOISE_FLOOR *
+				       fabs(d->mean[i]);
+			double deviation = fmax(sqrt(variance), floor);
+			if (deviation == 0)
+				deviation = 1;
+
+			double z = (metrics[i] - d->mean[i]) / deviation;
+			d->high[i] = fmax(0, d->high[i] + z - c->drift);
+			d->low[i] = fmax(0, d->low[i] - z - c->drift);
+			if (d->high[i] > c->threshold ||
+			    d->low[i] > c->threshold)
+				changed = true;
+		}
+	}
+
+	if (changed)
+		phase_detector_reset(d);
+
+	d->count++;
+	for (usize i = 0; i < metric_count; i++) {
+		double delta = metrics[i] - d->mean[i];
+		d->mean[i] += delta / (double)d->count;
+		d->m2[i] += delta * (metrics[i] - d->mean[i]);
+	}
+	return changed;
+}
+
+static void finish_phase(const sk_sampler *s, sk_phase *phase,
+			 const sk_sample *first, const sk_sample *last)
+{
+	phase->start_ns = first->time_ns;
+	phase->end_ns = last->time_ns;
+	sk_result_diff(&last->counts, &first->counts, &phase->counts);
+
+	usize cycles = 0;
+	usize instructions = 0;
+	phase->ipc = 0;
+	if (find_event(s->events, CYCLES_EVENTS, &cycles) &&
+	    find_event(s->events, INSTRUCTIONS_EVENTS, &instructions) &&
+	    phase->counts.counts[cycles] > 0)
+		phase->ipc = (double)phase->counts.counts[instructions] /
+			     (double)phase->counts.counts[cycles];
+}
+
+size_t sk_sampler_phases(const sk_sampler *s, const sk_phase_config *config,
+			 sk_phase *out, size_t max)
+{
+	const sk_events *e = s->events;
+	sk_phase_config c = {
+		.threshold = 5,
+		.drift = 0.5,
+		.min_samples = 3,
+	};
+	if (config && config->threshold > 0)
+		c.threshold = config->threshold;
+	if (config && config->drift > 0)
+		c.drift = config->drift;
+	if (config && config->min_samples > 1)
+		c.min_samples = config->min_samples;
+
+	usize cycles = 0;
+	usize instructions = 0;
+	bool has_ipc = find_event(e, CYCLES_EVENTS, &cycles) &&
+		       find_event(e, INSTRUCTIONS_EVENTS, &instructions);
+
+	// A phase runs from the sample that ended the previous one (or the
+	// first sample) to the sample before the next change.
+	usize count = sk_sampler_count(s);
+	if (count < 2 || max == 0)
+		return 0;
+
+	phase_detector d;
+	phase_detector_reset(&d);
+	usize phases = 0;
+	usize phase_start = 0;
+	for (usize i = 1; i < count; i++) {
+		const sk_sample *previous = sk_sampler_get(s, i - 1);
+		const sk_sample *sample = sk_sampler_get(s, i);
+		double seconds =
+			(double)(sample->time_ns - previous->time_ns) / 1e9;
+		if (seconds <= 0)
+			continue;
+
+		double metrics[PHASE_MAX_METRICS];
+		usize metric_count = 0;
+		u64 delta_cycles = 0;
+		u64 delta_instructions = 0;
+		for (usize j = 0; j < e->unique_count; j++) {
+			u64 delta = sample->counts.counts[j] -
+				    previous->counts.counts[j];
+			metrics[metric_count++] = (double)delta / seconds;
+			if (has_ipc && j == cycles)
+				delta_cycles = delta;
+			if (has_ipc && j == instructions)
+				delta_instructions = delta;
+		}
+		if (has_ipc)
+			metrics[metric_count++] =
+				delta_cycles ? (double)delta_instructions /
+						       (double)delta_cycles
+					     : 0;
+
+		if (!phase_detector_push(&d, metrics, metric_count, &c))
+			continue;
+		if (phases + 1 == max)
+			break;
+
+		usize phase_end = i - 1;
+		finish_phase(s, &out[phases++], sk_sampler_get(s, phase_start),
+			     sk_sampler_get(s, phase_end));
+		out[phases - 1].first_sample = phase_start;
+		out[phases - 1].sample_count = phase_end - phase_start + 1;
+		phase_start = phase_end;
+	}
+
+	finish_phase(s, &out[phases], sk_sampler_get(s, phase_start),
+		     sk_sampler_get(s, count - 1));
+	out[phases].first_sample = phase_start;
+	out[phases].sample_count = count - phase_start;
+	return phases + 1;
+}
+
+void sk_phases_print(const sk_phase *phases, size_t count)
+{
+	printf("\033[1m=== simple-kpc phases ===\033[m\n");
+	setlocale(LC_NUMERIC, "");
+	for (usize p = 0; p < count; p++) {
+		const sk_phase *phase = &phases[p];
+		const sk_events *e = phase->counts.events;
+		double seconds =
+			(double)(phase->end_ns - phase->start_ns) / 1e9;
+
+		printf("\n\033[1mphase %zu\033[m: %.3fs to %.3fs (%.3fs)",
+		       p + 1, (double)phase->start_ns / 1e9,
+		       (double)phase->end_ns / 1e9, seconds);
+		if (phase->ipc > 0)
+			printf(", IPC %.2f", phase->ipc);
+		printf("\n");
+
+		for (usize i = 0; i < e->count; i++) {
+			const char *name =
+				event_name(e, e->human_readable_names[i]);
+			double rate = seconds > 0 ? (double)sk_result_get(
+							    &phase->counts, i) /
+							    seconds
+						  : 0;
+			printf("\033[32m%'16.0f \033[95m%s/s\033[m\n", rate,
+			       name);
+		}
+	}
+}
+
+// Quantile sketches are KLL sketches (Karnin, Lang and Liberty, “Optimal
+// Quantile Approximation in Streams”). Level h holds items standing for 2^h
+// values each. Levels have capacities shrinking by 2/3 per level below the
+// top, and compaction is lazy: only when the whole sketch is over capacity
+// does the lowest full level get sorted, and every other item (starting at a
+// random offset) promoted to the level above. Updates are an append to level
+// zero nearly every time, and memory stays around 3k items however many
+// values arrive.
+
+#define SKETCH_DEFAULT_K 200
+#define SKETCH_MIN_WIDTH 8
+#define SKETCH_MAX_LEVELS 61
+
+struct sk_sketch {
+	u32 k;
+	u32 level_count;
+	u64 count;
+	u64 rng;
+	usize item_count;
+	usize capacity;
+	u64 *items[SKETCH_MAX_LEVELS];
+	u32 sizes[SKETCH_MAX_LEVELS];
+	u32 allocated[SKETCH_MAX_LEVELS];
+};
+
+static void sort_u64(u64 *a, usize n)
+{
+	while (n > 16) {
+		// Median of three, then a Hoare partition around it.
+		u64 x = a[0], y = a[n / 2], z = a[n - 1];
+		u64 pivot = x < y ? (y < z ? y : (x < z ? z : x))
+				  : (x < z ? x : (y < z ? z : y));
+		usize i = 0;
+		usize j = n - 1;
+		for (;;) {
+			while (a[i] < pivot)
+				i++;
+			while (a[j] > pivot)
+				j--;
+			if (i >= j)
+				break;
+			u64 t = a[i];
+			a[i++] = a[j];
+			a[j--] = t;
+		}
+
+		// Recurse into the smaller side, loop on the larger one.
+		usize left = j + 1;
+		if (left < n - left) {
+			sort_u64(a, left);
+			a += left;
+			n -= left;
+		} else {
+			sort_u64(a + left, n - left);
+			n = left;
+		}
+	}
+
+	for (usize i = 1; i < n; i++) {
+		u64 v = a[i];
+		usize j = i;
+		for (; j > 0 && a[j - 1] > v; j--)
+			a[j] = a[j - 1];
+		a[j] = v;
+	}
+}
+
+static u32 sketch_level_capacity(const sk_sketch *s, u32 level)
+{
+	double capacity = s->k;
+	for (u32 depth = s->level_count - 1 - level; depth > 0; depth--)
+		capacity *= 2.0 / 3.0;
+	u32 c = (u32)ceil(capacity);
+	return c < SKETCH_MIN_WIDTH ? SKETCH_MIN_WIDTH : c;
+}
+
+static void sketch_add_level(sk_sketch *s)
+{
+	if (s->level_count == SKETCH_MAX_LEVELS) {
+		fprintf(stderr, "simple_kpc: sketch has too many levels\n");
+		exit(1);
+	}
+	s->level_count++;
+
+	s->capacity = 0;
+	for (u32 h = 0; h < s->level_count; h++)
+		s->capacity += sketch_level_capacity(s, h);
+}
+
+static void sketch_append(sk_sketch *s, u32 level, u64 value)
+{
+	if (s->sizes[level] == s->allocated[level]) {
+		s->allocated[level] = (u32)grown_capacity(
+			s->allocated[level], s->sizes[level] + 1);
+		s->items[level] = xrealloc(s->items[level],
+					   s->allocated[level] * sizeof(u64));
+	}
+	s->items[level][s->sizes[level]++] = value;
+}
+
+static void sketch_compact(sk_sketch *s, u32 level)
+{
+	if (level + 1 == s->level_count)
+		sketch_add_level(s);
+
+	u64 *items = s->items[level];
+	u32 size = s->sizes[level];
+	sort_u64(items, size);
+
+	// An odd item out stays behind, so the weight of the level is kept.
+	u32 kept = size % 2;
+	u32 offset = (u32)(next_random(&s->rng) & 1);
+	for (u32 i = kept + offset; i < size; i += 2)
+		sketch_append(s, level + 1, items[i]);
+
+	s->sizes[level] = kept;
+	s->item_count -= size - kept - (size - kept) / 2;
+}
+
+static void sketch_compress(sk_sketch *s)
+{
+	while (s->item_count > s->capacity) {
+		u32 level = 0;
+		while (level + 1 < s->level_count &&
+		       s->sizes[level] < sketch_level_capacity(s, level))
+			level++;
+		sketch_compact(s, level);
+	}
+}
+
+sk_sketch *sk_sketch_create(uint32_t k)
+{
+	sk_sketch *s = calloc(1, sizeof(sk_sketch));
+	s->k = k ? k : SKETCH_DEFAULT_K;
+	s->rng = monotonic_ns();
+	sketch_add_level(s);
+	return s;
+}
+
+void sk_sketch_update(sk_sketch *s, uint64_t value)
+{
+	sketch_append(s, 0, value);
+	s->count++;
+	if (++s->item_count > s->capacity)
+		sketch_compress(s);
+}
+
+void sk_sketch_merge(sk_sketch *into, const sk_sketch *from)
+{
+	while (into->level_count < from->level_count)
+		sketch_add_level(into);
+
+	for (u32 h = 0; h < from->level_count; h++) {
+		for (u32 i = 0; i < from->sizes[h]; i++)
+			sketch_append(into, h, from->items[h][i]);
+		into->item_count += from->sizes[h];
+	}
+	into->count += from->count;
+	sketch_compress(into);
+}
+
+uint64_t sk_sketch_count(const sk_sketch *s)
+{
+	return s->count;
+}
+
+typedef struct {
+	u64 value;
+	u64 weight;
+} weighted_item;
+
+static int compare_weighted_items(const void *a, const void *b)
+{
+	u64 x = ((const weighted_item *)a)->value;
+	u64 y = ((const weighted_item *)b)->value;
+	return (x > y) - (x < y);
+}
+
+uint64_t sk_sketch_quantile(const sk_sketch *s, double q)
+{
+	if (s->item_count == 0)
+		return 0;
+
+	weighted_item *all = calloc(s->item_count, sizeof(weighted_item));
+	usize n = 0;
+	u64 total = 0;
+	for (u32 h = 0; h < s->level_count; h++) {
+		for (u32 i = 0; i < s->sizes[h]; i++) {
+			all[n++] = (weighted_item){ s->items[h][i], 1ull << h };
+			total += 1ull << h;
+		}
+	}
+	qsort(all, n, sizeof(weighted_item), compare_weighted_items);
+
+	double rank = q * (double)total;
+	u64 seen = 0;
+	u64 result = all[n - 1].value;
+	for (usize i = 0; i < n; i++) {
+		seen += all[i].weight;
+		if ((double)seen >= rank) {
+			result = all[i].value;
+			break;
+		}
+	}
+
+	free(all);
+	return result;
+}
+
+// Serialized sketches are a “SKQ1” tag followed by LEB128 varints: k, count,
+// the level count, then each level’s size and its items, sorted and
+// delta-encoded, which makes most of them one or two bytes.
+
+static usize put_varint(u8 *buf, usize size, usize at, u64 value)
+{
+	do {
+		u8 byte = value & 0x7f;
+		value >>= 7;
+		if (value)
+			byte |= 0x80;
+		if (at < size)
+			buf[at] = byte;
+		at++;
+	} while (value);
+	return at;
+}
+
+static bool get_varint(const u8 *buf, usize size, usize *at, u64 *value)
+{
+	*value = 0;
+	for (u32 shift = 0; shift < 64; shift += 7) {
+		if (*at >= size)
+			return false;
+		u8 byte = buf[(*at)++];
+		*value |= (u64)(byte & 0x7f) << shift;
+		if (!(byte & 0x80))
+			return true;
+	}
+	return false;
+}
+
+static const u8 SKETCH_TAG[4] = { 'S', 'K', 'Q', '1' };
+
+size_t sk_sketch_serialize(const sk_sketch *s, uint8_t *buf, size_t size)
+{
+	usize at = 0;
+	for (usize i = 0; i < sizeof(SKETCH_TAG); i++, at++) {
+		if (at < size)
+			buf[at] = SKETCH_TAG[i];
+	}
+	at = put_varint(buf, size, at, s->k);
+	at = put_varint(buf, size, at, s->count);
+	at = put_varint(buf, size, at, s->level_count);
+
+	for (u32 h = 0; h < s->level_count; h++) {
+		u32 n = s->sizes[h];
+		at = put_varint(buf, size, at, n);
+
+		// Sorting doesn’t change what the sketch means, only where its
+		// items sit, so it’s fine to do on a const sketch.
+		sort_u64(s->items[h], n);
+		u64 previous = 0;
+		for (u32 i = 0; i < n; i++) {
+			at = put_varint(buf, size, at,
+					s->items[h][i] - previous);
+			previous = s->items[h][i];
+		}
+	}
+	return at;
+}
+
+sk_sketch *sk_sketch_deserialize(const uint8_t *buf, size_t size)
+{
+	if (size < sizeof(SKETCH_TAG) ||
+	    memcmp(buf, SKETCH_TAG, sizeof(SKETCH_TAG)) != 0)
+		return NULL;
+
+	usize at = sizeof(SKETCH_TAG);
+	u64 k = 0;
+	u64 count = 0;
+	u64 level_count = 0;
+	if (!get_varint(buf, size, &at, &k) ||
+	    !get_varint(buf, size, &at, &count) ||
+	    !get_varint(buf, size, &at, &level_count) || k == 0 ||
+	    k > UINT32_MAX || level_count == 0 ||
+	    level_count > SKETCH_MAX_LEVELS)
+		return NULL;
+
+	sk_sketch *s = sk_sketch_create((u32)k);
+	while (s->level_count < level_count)
+		sketch_add_level(s);
+	s->count = count;
+
+	for (u32 h = 0; h < level_count; h++) {
+		u64 n = 0;
+		if (!get_varint(buf, size, &at, &n) || n > size) {
+			sk_sketch_destroy(s);
+			return NULL;
+		}
+
+		u64 value = 0;
+		for (u64 i = 0; i < n; i++) {
+			u64 delta = 0;
+			if (!get_varint(buf, size, &at, &delta)) {
+				sk_sketch_destroy(s);
+				return NULL;
+			}
+			value += delta;
+			sketch_append(s, h, value);
+		}
+		s->item_count += n;
+	}
+	return s;
+}
+
+void sk_sketch_destroy(sk_sketch *s)
+{
+	for (u32 h = 0; h < SKETCH_MAX_LEVELS; h++)
+		free(s->items[h]);
+	free(s);
+}
+
+// Regions. Each thread updates its own shard of a region, found through a
+// thread-local table indexed by region id, so entering and leaving a region
+// takes no locks and shares no cache lines. A shard is allocated the first
+// time its thread leaves the region and pushed onto the region’s list; reports
+// merge every shard on the list. Shards are written by one thread only, so
+// relaxed loads and stores are enough for reports to see whole values.
+//
+// Histograms are log-linear: values below 32 get a bucket each, and every
+// power of two above that is split into 32 buckets, so any value is within
+// about 3% of its bucket’s midpoint and 1920 buckets cover all of u64.
+
+#define HISTOGRAM_SUB_BITS 5
+#define HISTOGRAM_SUB_COUNT (1 << HISTOGRAM_SUB_BITS)
+#define HISTOGRAM_BUCKETS ((64 - HISTOGRAM_SUB_BITS + 1) * HISTOGRAM_SUB_COUNT)
+
+typedef _Atomic u64 histogram[HISTOGRAM_BUCKETS];
+
+typedef struct {
+	u64 key;
+	u64 tag;
+	u64 wall_ns;
+	u64 counts[KPC_MAX_COUNTERS];
+} slow_call;
+
+typedef struct region_shard {
+	struct region_shard *next;
+	_Atomic u64 calls;
+	_Atomic u64 samples; // calls that were measured
+	_Atomic u64 sums[KPC_MAX_COUNTERS];
+	_Atomic double sum_squares[KPC_MAX_COUNTERS];
+	histogram *histograms; // one per distinct event, if enabled
+	sk_sketch **sketches;  // likewise
+	_Atomic u64 wall_ns;   // over measured calls, for slowest calls
+	slow_call *slowest;    // min-heap on key, if enabled
+	usize slowest_count;
+
+	// Sampling state, touched only by the owning thread.
+	u64 countdown;
+	u64 period;
+	u64 rng;
+	u64 overhead_cycles; // cost of one measurement, calibrated per thread
+} region_shard;
+
+struct sk_region {
+	sk_events *events;
+	char *name;
+	unsigned flags;
+	usize id;
+	u64 generation;
+	_Atomic(region_shard *) shards;
+
+	u64 period;
+	double max_overhead;
+	bool has_cycles;
+	usize cycles;
+
+	usize slowest_capacity;
+	usize slowest_by; // distinct event
+};
+
+// Ids index each thread’s shard table and are reused once their region is
+// destroyed. Each reuse bumps the id’s generation, so a thread still holding
+// a shard from the region that had the id before sees that it is stale.
+#define REGION_ID_WORDS (SK_MAX_REGIONS / 64)
+
+static _Atomic u64 used_region_ids[REGION_ID_WORDS];
+static _Atomic u64 region_generations[SK_MAX_REGIONS];
+
+static _Thread_local struct {
+	region_shard *shard;
+	u64 generation;
+} thread_shards[SK_MAX_REGIONS];
+
+static bool claim_region_id(usize *id)
+{
+	for (usize w = 0; w < REGION_ID_WORDS; w++) {
+		u64 used = atomic_load(&used_region_ids[w]);
+		while (~used) {
+			u64 bit = ~used & (used + 1);
+			if (atomic_compare_exchange_weak(&used_region_ids[w],
+							 &used, used | bit)) {
+				*id = w * 64 + (usize)__builtin_ctzll(bit);
+				return true;
+			}
+		}
+	}
+	return false;
+}
+
+static void release_region_id(usize id)
+{
+	atomic_fetch_and(&used_region_ids[id / 64], ~(1ull << (id % 64)));
+}
+
+static usize histogram_bucket(u64 value)
+{
+	if (value < HISTOGRAM_SUB_COUNT)
+		return (usize)value;
+
+	u32 shift = 63 - (u32)__builtin_clzll(value) - HISTOGRAM_SUB_BITS;
+	return (shift + 1) * HISTOGRAM_SUB_COUNT +
+	       (usize)((value >> shift) - HISTOGRAM_SUB_COUNT);
+}
+
+static u64 histogram_bucket_midpoint(usize bucket)
+{
+	if (bucket < HISTOGRAM_SUB_COUNT)
+		return bucket;
+
+	u32 shift = (u32)(bucket / HISTOGRAM_SUB_COUNT) - 1;
+	u64 low = (u64)(HISTOGRAM_SUB_COUNT + bucket % HISTOGRAM_SUB_COUNT)
+		  << shift;
+	return low + ((1ull << shift) - 1) / 2;
+}
+
+static void relaxed_add(_Atomic u64 *p, u64 value)
+{
+	u64 current = atomic_load_explicit(p, memory_order_relaxed);
+	atomic_store_explicit(p, current + value, memory_order_relaxed);
+}
+
+sk_region *sk_region_create(sk_events *e, const char *name, unsigned flags)
+{
+	usize id;
+	if (!claim_region_id(&id)) {
+		fprintf(stderr,
+			"simple_kpc: at most %d regions can exist at once\n",
+			SK_MAX_REGIONS);
+		return NULL;
+	}
+
+	compile(e);
+	sk_region *r = calloc(1, sizeof(sk_region));
+	r->events = e;
+	r->name = strdup(name);
+	r->flags = flags;
+	r->id = id;
+	r->generation = atomic_fetch_add(&region_generations[id], 1) + 1;
+	atomic_init(&r->shards, NULL);
+	r->period = 1;
+	r->has_cycles = find_event(e, CYCLES_EVENTS, &r->cycles);
+	r->slowest_capacity = 16;
+	r->slowest_by = r->has_cycles ? r->cycles : 0;
+	return r;
+}
+
+// Sampled regions measure one call in period on average. With a max_overhead,
+// each thread retunes its own period after every measured call so that the
+// calibrated cost of measuring stays under that fraction of the cycles spent
+// in the region. That needs a cycles event; without one the period is fixed.
+void sk_region_set_sampling(sk_region *r, uint64_t period, double max_overhead)
+{
+	assert(r->flags & SK_REGION_SAMPLED);
+	assert(atomic_load(&r->shards) == NULL);
+	r->period = period ? period : 1;
+	r->max_overhead = max_overhead;
+}
+
+#define MAX_SAMPLING_PERIOD (1ull << 24)
+
+// Random countdowns with mean period avoid locking onto patterns in the calls.
+static u64 next_countdown(region_shard *shard)
+{
+	if (shard->period <= 1)
+		return 1;
+	return 1 + next_random(&shard->rng) % (2 * shard->period - 1);
+}
+
+// The cycles between back-to-back reads are what one extra read costs a
+// measured call, and a measured call makes two.
+static u64 calibrate_overhead(const sk_region *r)
+{
+	u64 first[KPC_MAX_COUNTERS];
+	u64 second[KPC_MAX_COUNTERS];
+	usize idx = r->events->counter_map[r->cycles];
+	u64 best = UINT64_MAX;
+	for (usize i = 0; i < 16; i++) {
+		kpc_get_thread_counters(0, KPC_MAX_COUNTERS, first);
+		kpc_get_thread_counters(0, KPC_MAX_COUNTERS, second);
+		u64 delta = second[idx] - first[idx];
+		if (delta < best)
+			best = delta;
+	}
+	return 2 * best;
+}
+
+static void adapt_period(const sk_region *r, region_shard *shard)
+{
+	u64 samples = atomic_load_explicit(&shard->samples,
+					   memory_order_relaxed);
+	u64 cycles = atomic_load_explicit(&shard->sums[r->cycles],
+					  memory_order_relaxed);
+	if (samples == 0 || cycles == 0)
+		return;
+
+	double mean = (double)cycles / (double)samples;
+	double period =
+		ceil((double)shard->overhead_cycles / (r->max_overhead * mean));
+	if (period < 1)
+		period = 1;
+	if (period > MAX_SAMPLING_PERIOD)
+		period = MAX_SAMPLING_PERIOD;
+	shard->period = (u64)period;
+}
+
+void sk_region_set_slowest(sk_region *r, size_t k, size_t i)
+{
+	assert(r->flags & SK_REGION_SLOWEST);
+	assert(i < r->events->count);
+	assert(atomic_load(&r->shards) == NULL);
+	r->slowest_capacity = k ? k : 1;
+	r->slowest_by = r->events->event_indices[i];
+}
+
+static void swap_slow_calls(slow_call *a, slow_call *b)
+{
+	slow_call t = *a;
+	*a = *b;
+	*b = t;
+}
+
+// Keeps the shard’s slowest calls as a min-heap, so a call that isn’t among
+// them costs one comparison with the root.
+static void keep_if_slow(const sk_region *r, region_shard *shard,
+			 const slow_call *call)
+{
+	slow_call *heap = shard->slowest;
+	usize n = shard->slowest_count;
+	usize i;
+	if (n < r->slowest_capacity) {
+		i = n;
+		heap[i] = *call;
+		shard->slowest_count++;
+		while (i > 0 && heap[(i - 1) / 2].key > heap[i].key) {
+			swap_slow_calls(&heap[(i - 1) / 2], &heap[i]);
+			i = (i - 1) / 2;
+		}
+		return;
+	}
+
+	if (call->key <= heap[0].key)
+		return;
+	heap[0] = *call;
+	i = 0;
+	for (;;) {
+		usize smallest = i;
+		usize left = 2 * i + 1;
+		usize right = left + 1;
+		if (left < n && heap[left].key < heap[smallest].key)
+			smallest = left;
+		if (right < n && heap[right].key < heap[smallest].key)
+			smallest = right;
+		if (smallest == i)
+			break;
+		swap_slow_calls(&heap[i], &heap[smallest]);
+		i = smallest;
+	}
+}
+
+static region_shard *thread_shard(sk_region *r)
+{
+	if (thread_shards[r->id].generation == r->generation)
+		return thread_shards[r->id].shard;
+
+	region_shard *shard = calloc(1, sizeof(region_shard));
+	if (r->flags & SK_REGION_HISTOGRAMS)
+		shard->histograms =
+			calloc(r->events->unique_count, sizeof(histogram));
+	if (r->flags & SK_REGION_SKETCHES) {
+		shard->sketches =
+			calloc(r->events->unique_count, sizeof(sk_sketch *));
+		for (usize j = 0; j < r->events->unique_count; j++)
+			shard->sketches[j] = sk_sketch_create(0);
+	}
+	if (r->flags & SK_REGION_SLOWEST)
+		shard->slowest = calloc(r->slowest_capacity, sizeof(slow_call));
+
+	if (r->flags & SK_REGION_SAMPLED) {
+		shard->period = r->period;
+		shard->rng = harness_seed();
+		shard->countdown = next_countdown(shard);
+		if (r->max_overhead > 0 && r->has_cycles)
+			shard->overhead_cycles = calibrate_overhead(r);
+	}
+
+	shard->next = atomic_load(&r->shards);
+	while (!atomic_compare_exchange_weak(&r->shards, &shard->next, shard)) {
+	}
+	thread_shards[r->id].shard = shard;
+	thread_shards[r->id].generation = r->generation;
+	return shard;
+}
+
+void sk_region_enter(sk_region *r, sk_region_scope *scope)
+{
+	if (r->flags & SK_REGION_SAMPLED) {
+		region_shard *shard = thread_shard(r);
+		if (--shard->countdown != 0) {
+			scope->measured = 0;
+			return;
+		}
+		shard->countdown = next_countdown(shard);
+	}
+
+	scope->measured = 1;
+	if (r->flags & SK_REGION_SLOWEST)
+		scope->start_ns = monotonic_ns();
+	kpc_get_thread_counters(0, KPC_MAX_COUNTERS, scope->counters);
+}
+
+void sk_region_exit(sk_region *r, sk_region_scope *scope)
+{
+	if (!scope->measured) {
+		relaxed_add(&thread_shard(r)->calls, 1);
+		return;
+	}
+
+	u64 after[KPC_MAX_COUNTERS];
+	kpc_get_thread_counters(0, KPC_MAX_COUNTERS, after);
+	u64 wall_ns = 0;
+	if (r->flags & SK_REGION_SLOWEST)
+		wall_ns = monotonic_ns() - scope->start_ns;
+
+	const sk_events *e = r->events;
+	region_shard *shard = thread_shard(r);
+	relaxed_add(&shard->calls, 1);
+	relaxed_add(&shard->samples, 1);
+	for (usize j = 0; j < e->unique_count; j++) {
+		usize idx = e->counter_map[j];
+		u64 delta = after[idx] - scope->counters[idx];
+		relaxed_add(&shard->sums[j], delta);
+
+		double squares = atomic_load_explicit(&shard->sum_squares[j],
+						      memory_order_relaxed);
+		atomic_store_explicit(&shard->sum_squares[j],
+				      squares + (double)delta * (double)delta,
+				      memory_order_relaxed);
+		if (shard->histograms)
+			relaxed_add(&shard->histograms[j][histogram_bucket(delta)],
+				    1);
+		if (shard->sketches)
+			sk_sketch_update(shard->sketches[j], delta);
+	}
+
+	if (shard->slowest) {
+		slow_call call = { .tag = scope->tag, .wall_ns = wall_ns };
+		for (usize j = 0; j < e->unique_count; j++) {
+			usize idx = e->counter_map[j];
+			call.counts[j] = after[idx] - scope->counters[idx];
+		}
+		call.key = call.counts[r->slowest_by];
+		relaxed_add(&shard->wall_ns, wall_ns);
+		keep_if_slow(r, shard, &call);
+	}
+
+	if (shard->overhead_cycles)
+		adapt_period(r, shard);
+}
+
+typedef struct {
+	u64 calls;
+	u64 samples;
+	u64 sum;
+	double sum_squares;
+} region_totals;
+
+// Totals over every shard for distinct event j.
+static region_totals merge_totals(sk_region *r, usize j)
+{
+	region_totals t = { 0 };
+	for (region_shard *shard = atomic_load(&r->shards); shard;
+	     shard = shard->next) {
+		t.calls += atomic_load_explicit(&shard->calls,
+						memory_order_relaxed);
+		t.samples += atomic_load_explicit(&shard->samples,
+						  memory_order_relaxed);
+		t.sum += atomic_load_explicit(&shard->sums[j],
+					      memory_order_relaxed);
+		t.sum_squares += atomic_load_explicit(&shard->sum_squares[j],
+						      memory_order_relaxed);
+	}
+	return t;
+}
+
+uint64_t sk_region_calls(sk_region *r)
+{
+	return merge_totals(r, 0).calls;
+}
+
+uint64_t sk_region_samples(sk_region *r)
+{
+	return merge_totals(r, 0).samples;
+}
+
+double sk_region_mean(sk_region *r, size_t i)
+{
+	assert(i < r->events->count);
+	region_totals t = merge_totals(r, r->events->event_indices[i]);
+	return t.samples ? (double)t.sum / (double)t.samples : 0;
+}
+
+// Scales the sampled mean up to every call. The interval is the usual 95% one
+// for a sample mean, narrowed by the finite population correction since the
+// sample is drawn from a known number of calls; it assumes the calls that were
+// skipped look like the ones that were measured.
+sk_estimate sk_region_estimate_total(sk_region *r, size_t i)
+{
+	assert(i < r->events->count);
+	region_totals t = merge_totals(r, r->events->event_indices[i]);
+	if (t.samples == 0)
+		return (sk_estimate){ 0 };
+
+	double n = (double)t.samples;
+	double calls = (double)t.calls;
+	double mean = (double)t.sum / n;
+	double total = mean * calls;
+	if (t.samples < 2 || t.samples == t.calls)
+		return (sk_estimate){ total, total, total };
+
+	double variance = fmax(0, (t.sum_squares - n * mean * mean) / (n - 1));
+	double error = 1.96 * calls * sqrt(variance / n) *
+		       sqrt(1 - n / calls);
+	return (sk_estimate){ total, fmax(0, total - error), total + error };
+}
+
+uint64_t sk_region_percentile(sk_region *r, size_t i, double percentile)
+{
+	assert(i < r->events->count);
+	assert(r->flags & SK_REGION_HISTOGRAMS);
+	usize j = r->events->event_indices[i];
+
+	u64 *merged = calloc(HISTOGRAM_BUCKETS, sizeof(u64));
+	u64 total = 0;
+	for (region_shard *shard = atomic_load(&r->shards); shard;
+	     shard = shard->next) {
+		for (usize b = 0; b < HISTOGRAM_BUCKETS; b++) {
+			u64 count = atomic_load_explicit(
+				&shard->histograms[j][b], memory_order_relaxed);
+			merged[b] += count;
+			total += count;
+		}
+	}
+
+	// The smallest bucket holding at least percentile% of calls.
+	u64 rank = (u64)ceil(percentile / 100 * (double)total);
+	if (rank == 0)
+		rank = 1;
+	u64 seen = 0;
+	u64 result = 0;
+	for (usize b = 0; b < HISTOGRAM_BUCKETS && total; b++) {
+		seen += merged[b];
+		if (seen >= rank) {
+			result = histogram_bucket_midpoint(b);
+			break;
+		}
+	}
+
+	free(merged);
+	return result;
+}
+
+sk_sketch *sk_region_sketch(sk_region *r, size_t i)
+{
+	assert(i < r->events->count);
+	assert(r->flags & SK_REGION_SKETCHES);
+	usize j = r->events->event_indices[i];
+
+	sk_sketch *merged = sk_sketch_create(0);
+	for (region_shard *shard = atomic_load(&r->shards); shard;
+	     shard = shard->next)
+		sk_sketch_merge(merged, shard->sketches[j]);
+	return merged;
+}
+
+// Sums the counts of every distinct event whose name matches the kind of
+// event asked for, returning false if there are none.
+static bool sum_events(const sk_events *e, bool (*matches)(const char *),
+		       const u64 *counts, double *out)
+{
+	bool found = false;
+	*out = 0;
+	for (usize j = 0; j < e->unique_count; j++) {
+		if (matches(event_name(e, e->unique_events[j]))) {
+			*out += (double)counts[j];
+			found = true;
+		}
+	}
+	return found;
+}
+
+static bool is_branch_miss_event(const char *name)
+{
+	return strstr(name, "MISP") || strstr(name, "BRANCH_MISS");
+}
+
+static bool is_cache_miss_event(const char *name)
+{
+	return strstr(name, "MISS") && !is_branch_miss_event(name);
+}
+
+static bool is_instructions_event(const char *name)
+{
+	for (const char *const *n = INSTRUCTIONS_EVENTS; *n; n++)
+		if (strcmp(name, *n) == 0)
+			return true;
+	return false;
+}
+
+// A call is off-CPU dominated if its cycles, at the rate the region’s
+// measured calls ran at on average, cover less than half its wall time.
+// Otherwise the kind of event that grew the most relative to the mean call
+// wins, as long as it at least grew by half.
+#define OFF_CPU_THRESHOLD 0.5
+#define CAUSE_MIN_GROWTH 1.5
+
+static sk_cause diagnose(sk_region *r, const slow_call *call,
+			 const u64 *sums, u64 samples, u64 wall_ns)
+{
+	const sk_events *e = r->events;
+	if (r->has_cycles && wall_ns && call->wall_ns) {
+		double cycles_per_ns =
+			(double)sums[r->cycles] / (double)wall_ns;
+		double on_cpu_ns = (double)call->counts[r->cycles] /
+				   cycles_per_ns;
+		if (on_cpu_ns < OFF_CPU_THRESHOLD * (double)call->wall_ns)
+			return SK_CAUSE_OFF_CPU;
+	}
+
+	static const struct {
+		sk_cause cause;
+		bool (*matches)(const char *);
+	} kinds[] = {
+		{ SK_CAUSE_CACHE_MISSES, is_cache_miss_event },
+		{ SK_CAUSE_BRANCH_MISSES, is_branch_miss_event },
+		{ SK_CAUSE_INSTRUCTIONS, is_instructions_event },
+	};
+
+	sk_cause cause = SK_CAUSE_UNKNOWN;
+	double best_growth = CAUSE_MIN_GROWTH;
+	for (usize k = 0; k < ARRAY_LENGTH(kinds); k++) {
+		double value, total;
+		if (!sum_events(e, kinds[k].matches, call->counts, &value))
+			continue;
+		sum_events(e, kinds[k].matches, sums, &total);
+		// Adding one keeps calls with rare events from dividing by zero.
+		double growth = (value + 1) / (total / (double)samples + 1);
+		if (growth > best_growth) {
+			best_growth = growth;
+			cause = kinds[k].cause;
+		}
+	}
+	return cause;
+}
+
+static int compare_slow_calls(const void *a, const void *b)
+{
+	u64 x = ((const slow_call *)a)->key;
+	u64 y = ((const slow_call *)b)->key;
+	return (x < y) - (x > y);
+}
+
+size_t sk_region_slowest(sk_region *r, sk_slow_call *out, size_t max)
+{
+	assert(r->flags & SK_REGION_SLOWEST);
+	const sk_events *e = r->events;
+
+	slow_call *all = NULL;
+	usize count = 0;
+	usize capacity = 0;
+	u64 sums[KPC_MAX_COUNTERS] = { 0 };
+	u64 samples = 0;
+	u64 wall_ns = 0;
+	for (region_shard *shard = atomic_load(&r->shards); shard;
+	     shard = shard->next) {
+		usize n = shard->slowest_count;
+		if (count + n > capacity) {
+			capacity = grown_capacity(capacity, count + n);
+			all = xrealloc(all, capacity * sizeof(slow_call));
+		}
+		memcpy(all + count, shard->slowest, n * sizeof(slow_call));
+		count += n;
+
+		for (usize j = 0; j < e->unique_count; j++)
+			sums[j] += atomic_load_explicit(&shard->sums[j],
+							memory_order_relaxed);
+		samples += atomic_load_explicit(&shard->samples,
+						memory_order_relaxed);
+		wall_ns += atomic_load_explicit(&shard->wall_ns,
+						memory_order_relaxed);
+	}
+
+	if (count > 0)
+		qsort(all, count, sizeof(slow_call), compare_slow_calls);
+	if (count > r->slowest_capacity)
+		count = r->slowest_capacity;
+	if (count > max)
+		count = max;
+
+	for (usize i = 0; i < count; i++) {
+		out[i] = (sk_slow_call){
+			.tag = all[i].tag,
+			.wall_ns = all[i].wall_ns,
+			.result = { .events = r->events, .host = &host },
+			.cause = diagnose(r, &all[i], sums, samples, wall_ns),
+		};
+		memcpy(out[i].result.counts, all[i].counts,
+		       sizeof(all[i].counts));
+	}
+	free(all);
+	return count;
+}
+
+const char *sk_cause_name(sk_cause cause)
+{
+	switch (cause) {
+	case SK_CAUSE_OFF_CPU:
+		return "off-CPU";
+	case SK_CAUSE_CACHE_MISSES:
+		return "cache misses";
+	case SK_CAUSE_BRANCH_MISSES:
+		return "branch misses";
+	case SK_CAUSE_INSTRUCTIONS:
+		return "instructions";
+	case SK_CAUSE_UNKNOWN:
+		break;
+	}
+	return "unknown";
+}
+
+#define SLOWEST_PRINTED 5
+
+void sk_region_print(sk_region *r)
+{
+	const sk_events *e = r->events;
+
+	printf("\033[1m=== simple-kpc region %s ===\033[m\n\n", r->name);
+	setlocale(LC_NUMERIC, "");
+	printf("\033[32m%'16llu \033[95mcalls\033[m\n",
+	       (unsigned long long)sk_region_calls(r));
+	if (r->flags & SK_REGION_SAMPLED)
+		printf("\033[32m%'16llu \033[95mmeasured\033[m\n",
+		       (unsigned long long)sk_region_samples(r));
+	for (usize i = 0; i < e->count; i++) {
+		const char *name = event_name(e, e->human_readable_names[i]);
+		printf("\033[32m%'16.1f \033[95m%s\033[m per call",
+		       sk_region_mean(r, i), name);
+		if (r->flags & SK_REGION_HISTOGRAMS)
+			printf(", p50 %'llu, p99 %'llu, p99.9 %'llu",
+			       (unsigned long long)sk_region_percentile(r, i, 50),
+			       (unsigned long long)sk_region_percentile(r, i, 99),
+			       (unsigned long long)sk_region_percentile(r, i,
+									99.9));
+		if (r->flags & SK_REGION_SKETCHES) {
+			sk_sketch *sketch = sk_region_sketch(r, i);
+			printf(", sketched p50 %'llu, p99 %'llu, p99.9 %'llu",
+			       (unsigned long long)sk_sketch_quantile(sketch,
+								      0.5),
+			       (unsigned long long)sk_sketch_quantile(sketch,
+								      0.99),
+			       (unsigned long long)sk_sketch_quantile(sketch,
+								      0.999));
+			sk_sketch_destroy(sketch);
+		}
+		if (r->flags & SK_REGION_SAMPLED) {
+			sk_estimate total = sk_region_estimate_total(r, i);
+			printf(", total ~%'.0f [%'.0f, %'.0f]", total.total,
+			       total.low, total.high);
+		}
+		printf("\n");
+	}
+
+	if (r->flags & SK_REGION_SLOWEST) {
+		const char *by = unique_event_name(e, r->slowest_by);
+		sk_slow_call slowest[SLOWEST_PRINTED];
+		usize n = sk_region_slowest(r, slowest, SLOWEST_PRINTED);
+		printf("\n\033[1mslowest by %s\033[m\n", by);
+		for (usize k = 0; k < n; k++) {
+			printf("\033[32m%'16llu \033[95m%s\033[m, tag %llu, "
+			       "%'llu ns, %s\n",
+			       (unsigned long long)
+				       slowest[k].result.counts[r->slowest_by],
+			       by, (unsigned long long)slowest[k].tag,
+			       (unsigned long long)slowest[k].wall_ns,
+			       sk_cause_name(slowest[k].cause));
+		}
+	}
+}
+
+// Shards stay reachable from threads’ tables after this, so no thread may be
+// inside r, or enter it again, once it is destroyed.
+void sk_region_destroy(sk_region *r)
+{
+	region_shard *shard = atomic_load(&r->shards);
+	while (shard) {
+		region_shard *next = shard->next;
+		free(shard->histograms);
+		for (usize j = 0; shard->sketches && j < r->events->unique_count;
+		     j++)
+			sk_sketch_destroy(shard->sketches[j]);
+		free(shard->sketches);
+		free(shard->slowest);
+		free(shard);
+		shard = next;
+	}
+	release_region_id(r->id);
+	free(r->name);
+	free(r);
 }
@@ -1,12 +1,468 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define SK_MAX_COUNTERS 32
+
 typedef struct sk_events sk_events;
 typedef struct sk_in_progress_measurement sk_in_progress_measurement;
 
 void sk_init(void);
 
+// The machine results come from, gathered once by sk_init. Unknown strings
+// are empty and unknown numbers -1; the flags are 1 or 0 when known. backend
+// is the kperf path that was loaded, or “replay”. Core types are only listed
+// on hybrid machines, with at least two: the PMUs with a cpus file in sysfs
+// (or under SK_SYSFS_PATH instead of /sys), in name order, on Linux, and the
+// performance levels on macOS.
+#define SK_MAX_CORE_TYPES 4
+
+typedef struct {
+	char cpu_model[128];
+	char microcode[32];
+	int physical_cores;
+	int logical_cores;
+	int smt;
+	char governor[32];
+	int turbo;
+	double nominal_ghz; // 0 if unknown, as on Apple Silicon
+	char kernel[160];
+	int perf_event_paranoid; // Linux only
+	char backend[256];
+	int virtualized;
+	size_t core_type_count;
+	struct {
+		char name[32];
+		int cpus;
+	} core_types[SK_MAX_CORE_TYPES];
+} sk_host;
+
+const sk_host *sk_host_get(void);
+void sk_host_print(const sk_host *h);
+// The index into sk_host’s core types of the CPU the caller is running on, or
+// -1 if that can’t be known (always, on macOS).
+int sk_current_core_type(void);
+
 sk_events *sk_events_create(void);
 void sk_events_push(sk_events *e, const char *human_readable_name,
 		    const char *internal_name);
 void sk_events_destroy(sk_events *e);
 
+// Without root, kpc won’t configure counters. Unless SK_REQUIRE_COUNTERS=1 is
+// set, sk_init then carries on with whatever stands in for each event, and
+// each event’s stand-in is reported on stderr when its set is first used:
+// macOS counts cycles and instructions for the whole process (through
+// proc_pid_rusage) without privileges, other systems replace cycles with the
+// thread’s CPU time, and every other event reads as zero.
+typedef enum {
+	SK_SOURCE_COUNTER, // a hardware counter, for this thread
+	SK_SOURCE_PROCESS, // summed over the whole process
+	SK_SOURCE_CPU_TIME,
+	SK_SOURCE_NONE,
+} sk_event_source;
+
+sk_event_source sk_events_source(const sk_events *e, size_t i);
+
+// Counts every event a second time in user space only, so results can split
+// each count between user space and the kernel (syscalls, page faults and
+// the like). It takes twice as many counters, and isn’t available in the
+// degraded mode above.
+void sk_events_split_modes(sk_events *e);
+
+// What the scheduler did to the measuring thread, read around the counters.
+// Time the thread spent runnable or blocked instead of running is wall_ns
+// minus cpu_ns. macOS has no per-thread context switch counts, so there they
+// are always 0 (and never mark a result preempted), and CPU numbers are only
+// known on Linux (elsewhere they are -1), where migrations is 1 if the thread
+// finished on a different CPU than it started on (so it is a lower bound).
+typedef struct {
+	uint64_t wall_ns;
+	uint64_t cpu_ns;
+	uint64_t voluntary_switches;
+	uint64_t involuntary_switches;
+	uint64_t migrations;
+	int32_t start_cpu;
+	int32_t end_cpu;
+	int32_t start_core_type; // see sk_current_core_type
+	int32_t end_core_type;
+} sk_scheduling;
+
+// Deltas from one measurement. counts is indexed by distinct event rather than
+// by push, so use sk_result_get to look up the value for push i. scheduling
+// is only filled in by measurements, not by regions; samplers fill in
+// wall_ns and cpu_ns, summed over their threads.
+//
+// elapsed_ns is the monotonic time between the two counter reads, timed
+// right next to them (scheduling.wall_ns also covers the scheduling reads
+// around them). elapsed_ticks is the same span in TSC ticks on x86 or
+// virtual counter ticks on arm64, and 0 elsewhere. Regions leave both 0.
+typedef struct {
+	sk_events *events;
+	uint64_t counts[SK_MAX_COUNTERS];
+	uint64_t user_counts[SK_MAX_COUNTERS]; // if split, see below
+	uint64_t elapsed_ns;
+	uint64_t elapsed_ticks;
+	sk_scheduling scheduling;
+	const sk_host *host;
+} sk_result;
+
 sk_in_progress_measurement *sk_start_measurement(sk_events *e);
 void sk_finish_measurement(sk_in_progress_measurement *m);
+void sk_stop_measurement(sk_in_progress_measurement *m, sk_result *out);
+
+// Reads the deltas so far without stopping the measurement. Like the other
+// measurement calls it must run on the thread that started m. Diffing two
+// snapshots gives the counts for the phase between them.
+void sk_measurement_snapshot(sk_in_progress_measurement *m, sk_result *out);
+void sk_result_diff(const sk_result *later, const sk_result *earlier,
+		    sk_result *out);
+
+uint64_t sk_result_get(const sk_result *r, size_t i);
+// For events split with sk_events_split_modes.
+uint64_t sk_result_get_user(const sk_result *r, size_t i);
+uint64_t sk_result_get_kernel(const sk_result *r, size_t i);
+// Push i per second of elapsed_ns, and elapsed nanoseconds per occurrence of
+// push i, so runs of different lengths can be compared. Both are 0 when
+// there is nothing to divide by.
+double sk_result_per_second(const sk_result *r, size_t i);
+double sk_result_ns_per_event(const sk_result *r, size_t i);
+void sk_result_print(const sk_result *r);
+
+// Why a measurement’s counts can’t be trusted: the thread was preempted
+// (involuntarily switched out) or moved to another CPU partway through, or,
+// when both cycles and reference cycles are counted, its clock rate was off
+// from that of the other runs of the same harness. sk_compare and
+// sk_gate_run discard disturbed runs and run again, up to
+// SK_MAX_DISTURBED_RETRIES times per run, keeping the last attempt if every
+// one was disturbed.
+enum {
+	SK_DISTURBED_PREEMPTED = 1 << 0,
+	SK_DISTURBED_MIGRATED = 1 << 1,
+	SK_DISTURBED_FREQUENCY = 1 << 2,
+	// Finished on a different kind of core (and PMU) than it started on.
+	SK_DISTURBED_CORE_TYPE = 1 << 3,
+};
+
+#define SK_MAX_DISTURBED_RETRIES 10
+
+// Returns the SK_DISTURBED_* flags that one result alone can show; frequency
+// changes need other runs to compare with.
+unsigned sk_result_disturbances(const sk_result *r);
+
+// Cycles per nanosecond the thread spent on a CPU, or 0 without cycles or
+// CPU time (results from regions, or degraded counting).
+double sk_result_frequency(const sk_result *r);
+// Copies r with its cycle counts scaled to what they would have been at
+// nominal_ghz (or, given 0, sk_host’s nominal frequency), so cycles from runs
+// at different clocks can be compared. Without both frequencies, out is r.
+void sk_result_normalize_frequency(const sk_result *r, double nominal_ghz,
+				   sk_result *out);
+
+// Regions accumulate per-call counts for a named stretch of code entered from
+// any number of threads. The caller arms the events (sk_events_arm) before
+// regions are entered and disarms them afterwards. A scope holds the counters
+// read on entry and lives on the caller’s stack, so regions can nest and be
+// entered from several threads at once. At most SK_MAX_REGIONS regions can
+// exist at once; beyond that sk_region_create returns NULL.
+#define SK_MAX_REGIONS 256
+
+enum {
+	// Keep a fixed-size log-linear histogram of per-call counts for each
+	// event, for sk_region_percentile.
+	SK_REGION_HISTOGRAMS = 1 << 0,
+	// Keep a quantile sketch of per-call counts for each event, for
+	// sk_region_sketch. Sketches are merged without locks, so only ask for
+	// one while no thread is inside the region.
+	SK_REGION_SKETCHES = 1 << 1,
+	// Only measure about one call in every sampling period (see
+	// sk_region_set_sampling); the rest cost a thread-local countdown.
+	// Means, histograms and sketches then describe the measured calls, and
+	// sk_region_estimate_total extrapolates to all of them.
+	SK_REGION_SAMPLED = 1 << 2,
+	// Keep every count of the slowest calls, by one event (see
+	// sk_region_set_slowest), for sk_region_slowest. Like sketches, only
+	// ask for them while no thread is inside the region.
+	SK_REGION_SLOWEST = 1 << 3,
+};
+
+typedef struct {
+	uint64_t counters[SK_MAX_COUNTERS];
+	int measured;
+	uint64_t start_ns;
+	uint64_t tag; // set by the caller before exit; kept with slowest calls
+} sk_region_scope;
+
+typedef struct {
+	double total;
+	double low; // 95% confidence interval
+	double high;
+} sk_estimate;
+
+// What made a slow call slow, judged against the region’s mean call: time
+// spent off the CPU (wall time the cycles don’t account for), or whichever of
+// cache misses, branch misses and instructions grew the most. Events are
+// recognized by name, so causes without a matching event are never chosen.
+typedef enum {
+	SK_CAUSE_UNKNOWN,
+	SK_CAUSE_OFF_CPU,
+	SK_CAUSE_CACHE_MISSES,
+	SK_CAUSE_BRANCH_MISSES,
+	SK_CAUSE_INSTRUCTIONS,
+} sk_cause;
+
+typedef struct {
+	uint64_t tag;
+	uint64_t wall_ns;
+	sk_result result;
+	sk_cause cause;
+} sk_slow_call;
+
+// A mergeable KLL quantile sketch over uint64_t values, using memory
+// proportional to k (200 if zero) however many values it sees. Its rank error
+// is around 1.65/k. Serialized sketches can be shipped between processes and
+// merged there; sk_sketch_serialize returns the size it needs, writing only if
+// buf is at least that big.
+typedef struct sk_sketch sk_sketch;
+
+sk_sketch *sk_sketch_create(uint32_t k);
+void sk_sketch_update(sk_sketch *s, uint64_t value);
+void sk_sketch_merge(sk_sketch *into, const sk_sketch *from);
+uint64_t sk_sketch_count(const sk_sketch *s);
+uint64_t sk_sketch_quantile(const sk_sketch *s, double q);
+size_t sk_sketch_serialize(const sk_sketch *s, uint8_t *buf, size_t size);
+sk_sketch *sk_sketch_deserialize(const uint8_t *buf, size_t size);
+void sk_sketch_destroy(sk_sketch *s);
+
+typedef struct sk_region sk_region;
+
+sk_region *sk_region_create(sk_events *e, const char *name, unsigned flags);
+void sk_region_enter(sk_region *r, sk_region_scope *scope);
+void sk_region_exit(sk_region *r, sk_region_scope *scope);
+// Measures one call in period on average; with a nonzero max_overhead (say
+// 0.01 for 1%), each thread instead tunes its period to keep the cost of
+// measuring under that fraction of the region’s cycles. Threads take these
+// settings the first time they enter the region, so set them before that.
+void sk_region_set_sampling(sk_region *r, uint64_t period, double max_overhead);
+uint64_t sk_region_calls(sk_region *r);
+uint64_t sk_region_samples(sk_region *r);
+double sk_region_mean(sk_region *r, size_t i);
+sk_estimate sk_region_estimate_total(sk_region *r, size_t i);
+uint64_t sk_region_percentile(sk_region *r, size_t i, double percentile);
+sk_sketch *sk_region_sketch(sk_region *r, size_t i);
+// Keeps the k calls with the largest count of event i on each thread. Without
+// it, regions keep 16 calls by cycles, or by the first event if cycles aren’t
+// counted.
+void sk_region_set_slowest(sk_region *r, size_t k, size_t i);
+// Fills out with up to max of the slowest calls over all threads, slowest
+// first, and returns how many there were.
+size_t sk_region_slowest(sk_region *r, sk_slow_call *out, size_t max);
+const char *sk_cause_name(sk_cause cause);
+void sk_region_print(sk_region *r);
+void sk_region_destroy(sk_region *r);
+
+// Samples the counters of a set of threads at a fixed interval into a
+// preallocated ring of cumulative, timestamped results. Each watched thread
+// calls sk_sampler_add_thread before start (by default, the thread calling
+// sk_sampler_start is watched) and must stay alive until stop, since it is
+// interrupted with config.signal whenever it is sampled. Only one sampler can
+// run at a time; starting a second before stopping the first asserts.
+#define SK_SAMPLER_MAX_THREADS 64
+
+typedef struct {
+	uint64_t interval_ns; // default 10ms
+	size_t capacity;      // records kept, oldest overwritten; default 4096
+	int signal;           // default SIGPROF
+} sk_sampler_config;
+
+typedef struct {
+	uint64_t time_ns; // since sk_sampler_start
+	sk_result counts; // summed over watched threads, since start
+} sk_sample;
+
+typedef struct sk_sampler sk_sampler;
+
+sk_sampler *sk_sampler_create(sk_events *e, const sk_sampler_config *config);
+void sk_sampler_add_thread(sk_sampler *s);
+void sk_sampler_start(sk_sampler *s);
+void sk_sampler_stop(sk_sampler *s);
+size_t sk_sampler_count(const sk_sampler *s);
+const sk_sample *sk_sampler_get(const sk_sampler *s, size_t i);
+// Counts since start on one of sk_host’s core types. Each interval goes to
+// the core type its thread was on when the interval was sampled, so the
+// shorter the interval, the truer the split.
+void sk_sampler_core_type_counts(const sk_sampler *s, size_t type,
+				 sk_result *out);
+
+// Stretches of consecutive intervals whose effective frequency (cycles per
+// nanosecond the watched threads ran) fell more than threshold (default 0.1)
+// below the nominal frequency, or, if that isn’t known, the 95th percentile
+// over the series. Intervals where the threads were mostly idle are skipped.
+// Writes at most max episodes to out and returns how many were written.
+typedef struct {
+	uint64_t start_ns;
+	uint64_t end_ns;
+	double min_ghz;
+	double mean_ghz;
+} sk_throttle;
+
+size_t sk_sampler_throttling(const sk_sampler *s, double threshold,
+			     sk_throttle *out, size_t max);
+
+// One row per interval: counts and per-second rates for every push, plus IPC
+// when both cycles and instructions are being counted and the effective
+// frequency in GHz when cycles are. The host is written first as “#” comment
+// lines.
+int sk_sampler_write_csv(const sk_sampler *s, const char *path);
+void sk_sampler_destroy(sk_sampler *s);
+
+// Splits a sampler’s series into phases with an online change-point detector
+// (a two-sided CUSUM over each event’s rate and IPC), writing at most max
+// phases to out and returning how many were written. Zero fields in config
+// pick the defaults shown.
+typedef struct {
+	double threshold;   // CUSUM decision threshold, in deviations; 5
+	double drift;       // slack subtracted per sample, in deviations; 0.5
+	size_t min_samples; // samples a phase needs before it can end; 3
+} sk_phase_config;
+
+typedef struct {
+	uint64_t start_ns;
+	uint64_t end_ns;
+	size_t first_sample;
+	size_t sample_count;
+	double ipc; // zero unless cycles and instructions are both counted
+	sk_result counts;
+} sk_phase;
+
+size_t sk_sampler_phases(const sk_sampler *s, const sk_phase_config *config,
+			 sk_phase *out, size_t max);
+void sk_phases_print(const sk_phase *phases, size_t count);
+
+// Runs a and b runs times each, interleaved in random order under the same
+// events, and compares them per event.
+typedef void (*sk_callback)(void *context);
+
+typedef enum {
+	SK_NO_DIFFERENCE,
+	SK_B_FEWER,
+	SK_B_MORE,
+} sk_verdict;
+
+typedef struct {
+	double median_a;
+	double median_b;
+	// Relative change of the median from a to b, with a 95% bootstrap
+	// confidence interval.
+	double change;
+	double change_low;
+	double change_high;
+	// Two-sided Mann-Whitney U test.
+	double p_value;
+	// Only significant if p < 0.05 and the interval excludes zero.
+	sk_verdict verdict;
+} sk_event_comparison;
+
+typedef struct sk_comparison sk_comparison;
+
+sk_comparison *sk_compare(sk_events *e, size_t runs, sk_callback a,
+			  void *a_context, sk_callback b, void *b_context);
+const sk_event_comparison *sk_comparison_get(const sk_comparison *c, size_t i);
+// How many disturbed runs were thrown away and rerun.
+size_t sk_comparison_discarded(const sk_comparison *c);
+void sk_comparison_print(const sk_comparison *c);
+void sk_comparison_destroy(sk_comparison *c);
+
+// Evicts memory from the caches between runs. Buffers added to a flusher
+// are flushed line by line; with none added, or on CPUs where user space
+// can’t flush lines, a buffer twice the size of the last-level cache (read
+// from sysfs or sysctl, else assumed to be 32 MiB) is swept instead.
+typedef struct sk_cache_flusher sk_cache_flusher;
+
+sk_cache_flusher *sk_cache_flusher_create(void);
+void sk_cache_flusher_add_buffer(sk_cache_flusher *fl, const void *start,
+				 size_t size);
+size_t sk_cache_flusher_llc_bytes(const sk_cache_flusher *fl);
+void sk_cache_flush(sk_cache_flusher *fl);
+void sk_cache_flusher_destroy(sk_cache_flusher *fl);
+
+// Runs f runs times each with warm caches (after an untimed call) and cold
+// ones (after sk_cache_flush), interleaved like sk_compare, and compares them
+// with warm as A and cold as B.
+sk_comparison *sk_compare_cache_states(sk_events *e, size_t runs,
+				       sk_callback f, void *context,
+				       sk_cache_flusher *fl);
+
+// Measures each added benchmark and compares the median of runs against the
+// counts stored at baseline_path. An event regresses when it grows by more
+// than its tolerance (5% unless set). sk_gate_run returns 1 if anything
+// regressed, else 0, so it can be returned from main. If there is no baseline
+// yet, or SK_UPDATE_BASELINE=1 is set, it writes one instead.
+typedef struct sk_gate sk_gate;
+
+sk_gate *sk_gate_create(sk_events *e, const char *baseline_path);
+void sk_gate_set_tolerance(sk_gate *g, size_t i, double tolerance);
+void sk_gate_add(sk_gate *g, const char *name, sk_callback f, void *context);
+int sk_gate_run(sk_gate *g, size_t runs);
+void sk_gate_destroy(sk_gate *g);
+
+// Counts the user-space instructions f retires by single-stepping it in a
+// forked, traced child. It needs no counters (or sk_init) at all, so it works
+// on VMs without a PMU, and the count is exact, but each instruction costs a
+// round trip through the kernel. f runs in the child, so its side effects are
+// lost. Returns 0 on success, or -1 if the child couldn’t be traced or f
+// crashed (SIGSEGV, SIGBUS, SIGILL, SIGFPE or SIGABRT).
+int sk_count_instructions(sk_callback f, void *context, uint64_t *out);
+
+// Sets up the calling thread for stable counts: pinned to one CPU, running
+// as SCHED_FIFO, with memory locked and both its stack and a heap arena
+// faulted in ahead of time. Settings that can’t be applied, usually for lack
+// of privileges, are skipped and reported by sk_isolation_failures and
+// sk_isolation_print; sk_restore undoes the rest and must run on the same
+// thread.
+enum {
+	SK_ISOLATE_AFFINITY = 1 << 0,
+	SK_ISOLATE_REALTIME = 1 << 1,
+	SK_ISOLATE_MEMORY_LOCK = 1 << 2,
+	SK_ISOLATE_ARENA = 1 << 3,
+};
+
+#define SK_ISOLATE_SETTINGS 4
+
+typedef struct {
+	int cpu;            // -1 leaves affinity alone
+	int realtime;       // raise to SCHED_FIFO at its top priority
+	int lock_memory;    // mlockall current and future pages
+	size_t stack_bytes; // stack to prefault; 0 means 256 KiB
+	size_t arena_bytes; // heap arena to prefault, see sk_isolation_arena
+} sk_isolate_config;
+
+typedef struct sk_isolation sk_isolation;
+
+sk_isolation *sk_isolate(const sk_isolate_config *config);
+unsigned sk_isolation_failures(const sk_isolation *iso);
+// The prefaulted arena, for the benchmark to carve its buffers from.
+void *sk_isolation_arena(const sk_isolation *iso, size_t *size);
+void sk_isolation_print(const sk_isolation *iso);
+void sk_restore(sk_isolation *iso);
+
+// Low-level access for callers that pair reads themselves (see
+// simple_kpc.hpp). Between sk_events_arm and sk_events_disarm, the reader fills
+// a buffer of SK_MAX_COUNTERS raw counter values; push i of e lives at
+// sk_events_counter_index(e, i) in that buffer.
+typedef int (*sk_counter_reader)(uint32_t tid, uint32_t buf_count,
+				 uint64_t *buf);
+
+size_t sk_events_count(const sk_events *e);
+size_t sk_events_counter_index(sk_events *e, size_t i);
+void sk_events_arm(sk_events *e);
+void sk_events_disarm(sk_events *e);
+sk_counter_reader sk_get_counter_reader(void);
+
+#ifdef __cplusplus
+}
+#endif
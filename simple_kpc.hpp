@@ -0,0 +1,118 @@
+#pragma once
+
+#include "simple_kpc.h"
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+
+namespace sk {
+
+// An event is any type with two static string members:
+//
+//	struct Cycles {
+//		static constexpr const char *name = "cycles";
+//		static constexpr const char *internal_name = "FIXED_CYCLES";
+//	};
+//
+// The event set is fixed at compile time, so a result is a plain std::array
+// and reading it back needs no lookups. Counting is on while any measurement
+// is in progress, so scopes can nest; like kpc itself, an Events isn’t meant
+// to be shared between threads.
+template <typename... Ev> class Events {
+public:
+	static constexpr std::size_t count = sizeof...(Ev);
+	static_assert(count > 0, "an event set needs at least one event");
+	static_assert(count <= SK_MAX_COUNTERS, "too many events");
+
+	using Result = std::array<std::uint64_t, count>;
+	using Raw = std::array<std::uint64_t, SK_MAX_COUNTERS>;
+
+	static constexpr std::array<const char *, count> names = { Ev::name... };
+	static constexpr std::array<const char *, count> internal_names = {
+		Ev::internal_name...
+	};
+
+	Events()
+	{
+		sk_init();
+		events = sk_events_create();
+		for (std::size_t i = 0; i < count; i++)
+			sk_events_push(events, names[i], internal_names[i]);
+		for (std::size_t i = 0; i < count; i++)
+			indices[i] = sk_events_counter_index(events, i);
+		reader = sk_get_counter_reader();
+	}
+
+	~Events()
+	{
+		sk_events_destroy(events);
+	}
+
+	Events(const Events &) = delete;
+	Events &operator=(const Events &) = delete;
+
+	sk_events *get()
+	{
+		return events;
+	}
+
+	// Don’t put any library code below the read!
+	void start(Raw &before)
+	{
+		if (active++ == 0)
+			sk_events_arm(events);
+		reader(0, SK_MAX_COUNTERS, before.data());
+	}
+
+	// Don’t put any library code above the read!
+	void finish(const Raw &before, Result &result)
+	{
+		Raw after;
+		reader(0, SK_MAX_COUNTERS, after.data());
+		if (--active == 0)
+			sk_events_disarm(events);
+		for (std::size_t i = 0; i < count; i++)
+			result[i] = after[indices[i]] - before[indices[i]];
+	}
+
+private:
+	sk_events *events;
+	std::array<std::size_t, count> indices;
+	sk_counter_reader reader;
+	std::size_t active = 0; // measurements in progress
+};
+
+// Before C++17, static constexpr members still need a definition.
+template <typename... Ev>
+constexpr std::array<const char *, Events<Ev...>::count> Events<Ev...>::names;
+template <typename... Ev>
+constexpr std::array<const char *, Events<Ev...>::count>
+	Events<Ev...>::internal_names;
+
+// Counts the events in E from construction to destruction and stores the
+// deltas in the result it was given, so early returns and exceptions can’t
+// leave a measurement unfinished.
+template <typename E> class Scope {
+public:
+	Scope(E &events, typename E::Result &result)
+		: events(events), result(result)
+	{
+		events.start(before);
+	}
+
+	~Scope()
+	{
+		events.finish(before, result);
+	}
+
+	Scope(const Scope &) = delete;
+	Scope &operator=(const Scope &) = delete;
+
+private:
+	E &events;
+	typename E::Result &result;
+	typename E::Raw before;
+};
+
+} // namespace sk
@@ -0,0 +1,110 @@
+#pragma once
+
+#include "simple_kpc.hpp"
+
+#include <benchmark/benchmark.h>
+
+#include <string>
+
+namespace sk {
+
+// Reports Ev... as Google Benchmark user counters, normalized per iteration.
+// Loop over it instead of over the state:
+//
+//	static void BM_foo(benchmark::State &state)
+//	{
+//		setup();
+//		sk::BenchmarkCounters<Cycles, Instructions> counters(state);
+//		for (auto _ : counters)
+//			foo();
+//	}
+//
+// Counting starts once Google Benchmark has started its timer and stops when
+// the loop ends, so setup before the loop isn’t counted. Sections inside the
+// loop between PauseTiming and ResumeTiming are, as is stopping the timer
+// once per batch.
+//
+// Google Benchmark calls BM_foo once per iteration batch. Every batch of every
+// benchmark using the same Ev... shares one compiled configuration, built the
+// first time it’s needed.
+template <typename... Ev> class BenchmarkCounters {
+public:
+	using E = Events<Ev...>;
+
+	class Iterator {
+	public:
+		Iterator(benchmark::State::StateIterator inner,
+			 BenchmarkCounters *counters)
+			: inner(inner), counters(counters)
+		{
+		}
+
+		benchmark::State::StateIterator::Value operator*() const
+		{
+			return *inner;
+		}
+
+		Iterator &operator++()
+		{
+			++inner;
+			return *this;
+		}
+
+		bool operator!=(const Iterator &end)
+		{
+			if (inner != end.inner)
+				return true;
+			counters->finish();
+			return false;
+		}
+
+	private:
+		benchmark::State::StateIterator inner;
+		BenchmarkCounters *counters;
+	};
+
+	explicit BenchmarkCounters(benchmark::State &state) : state(state)
+	{
+	}
+
+	BenchmarkCounters(const BenchmarkCounters &) = delete;
+	BenchmarkCounters &operator=(const BenchmarkCounters &) = delete;
+
+	Iterator begin()
+	{
+		return Iterator(state.begin(), this);
+	}
+
+	// The range-for calls this after begin, and State::end starts the timer.
+	Iterator end()
+	{
+		Iterator end(state.end(), this);
+		events().start(before);
+		return end;
+	}
+
+private:
+	static E &events()
+	{
+		static E shared;
+		return shared;
+	}
+
+	void finish()
+	{
+		typename E::Result result;
+		events().finish(before, result);
+
+		for (std::size_t i = 0; i < E::count; i++) {
+			std::string name = std::string(E::names[i]) + "/iter";
+			state.counters[name] = benchmark::Counter(
+				static_cast<double>(result[i]),
+				benchmark::Counter::kAvgIterations);
+		}
+	}
+
+	benchmark::State &state;
+	typename E::Raw before;
+};
+
+} // namespace sk